@@ -30,6 +30,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/IPO/ArgumentPromotion.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DepthFirstIterator.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/Statistic.h"
@@ -51,6 +52,7 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO.h"
@@ -63,6 +65,16 @@ STATISTIC(NumArgumentsPromoted, "Number of pointer arguments promoted");
 STATISTIC(NumAggregatesPromoted, "Number of aggregate arguments promoted");
 STATISTIC(NumByValArgsPromoted, "Number of byval arguments promoted");
 STATISTIC(NumArgumentsDead, "Number of dead pointer args eliminated");
+STATISTIC(NumClonesAvoided,
+          "Number of function re-clones avoided by nested promotion");
+
+// Promoting a pointer-to-pointer argument exposes the loaded pointer as a new
+// argument that is typically promotable in turn, which would otherwise cost a
+// second clone-and-rewrite of the function on the next SCC iteration.
+static cl::opt<bool> EnableNestedPromotion(
+    "argpromotion-nested", cl::init(true), cl::Hidden,
+    cl::desc("Promote loaded pointer arguments through both levels of "
+             "indirection in a single clone"));
 
 /// A vector used to hold the indices of a single GEP instruction
 typedef std::vector<uint64_t> IndicesVector;
@@ -70,9 +82,15 @@ typedef std::vector<uint64_t> IndicesVector;
 /// DoPromotion - This method actually performs the promotion of the specified
 /// arguments, and returns the new function.  At this point, we know that it's
 /// safe to do so.
+///
+/// Arguments in NestedArgsToPromote are a subset of ArgsToPromote that are only
+/// loaded directly, and whose loaded pointer is itself only loaded from. They
+/// are passed as the pointee of the loaded pointer, with the mapped load used as
+/// the representative of those inner loads.
 static Function *
 doPromotion(Function *F, SmallPtrSetImpl<Argument *> &ArgsToPromote,
             SmallPtrSetImpl<Argument *> &ByValArgsToTransform,
+            DenseMap<Argument *, LoadInst *> &NestedArgsToPromote,
             Optional<function_ref<void(CallSite OldCS, CallSite NewCS)>>
                 ReplaceCallSite) {
 
@@ -169,6 +187,15 @@ doPromotion(Function *F, SmallPtrSetImpl<Argument *> &ArgsToPromote,
         assert(Params.back());
       }
 
+      // A nested argument is passed as the value its loaded pointer points
+      // to, rather than as the loaded pointer itself.
+      if (NestedArgsToPromote.count(&*I)) {
+        assert(ArgIndices.size() == 1 && ArgIndices.begin()->second.empty() &&
+               "Nested promotion requires only direct loads!");
+        Params.back() = NestedArgsToPromote[&*I]->getType();
+        ++NumClonesAvoided;
+      }
+
       if (ArgIndices.size() == 1 && ArgIndices.begin()->second.empty())
         ++NumArgumentsPromoted;
       else
@@ -274,6 +301,15 @@ doPromotion(Function *F, SmallPtrSetImpl<Argument *> &ArgsToPromote,
           OrigLoad->getAAMetadata(AAInfo);
           newLoad->setAAMetadata(AAInfo);
 
+          // For nested arguments, also perform the load of the loaded pointer
+          // in the caller.
+          if (LoadInst *NestedLoad = NestedArgsToPromote.lookup(&*I)) {
+            newLoad = new LoadInst(newLoad, newLoad->getName() + ".val", Call);
+            newLoad->setAlignment(NestedLoad->getAlignment());
+            NestedLoad->getAAMetadata(AAInfo);
+            newLoad->setAAMetadata(AAInfo);
+          }
+
           Args.push_back(newLoad);
           ArgAttrVec.push_back(AttributeSet());
         }
@@ -393,8 +429,19 @@ doPromotion(Function *F, SmallPtrSetImpl<Argument *> &ArgsToPromote,
       if (LoadInst *LI = dyn_cast<LoadInst>(I->user_back())) {
         assert(ArgIndices.begin()->second.empty() &&
                "Load element should sort to front!");
-        I2->setName(I->getName() + ".val");
-        LI->replaceAllUsesWith(&*I2);
+        if (NestedArgsToPromote.count(&*I)) {
+          // All of the uses of the loaded pointer are loads, which now use
+          // the new argument instead.
+          I2->setName(I->getName() + ".val.val");
+          while (!LI->use_empty()) {
+            LoadInst *L = cast<LoadInst>(LI->user_back());
+            L->replaceAllUsesWith(&*I2);
+            L->eraseFromParent();
+          }
+        } else {
+          I2->setName(I->getName() + ".val");
+          LI->replaceAllUsesWith(&*I2);
+        }
         LI->eraseFromParent();
         DEBUG(dbgs() << "*** Promoted load of argument '" << I->getName()
                      << "' in function '" << F->getName() << "'\n");
@@ -708,6 +755,64 @@ static bool isSafeToPromoteArgument(Argument *Arg, bool isByValOrInAlloca,
   return true;
 }
 
+/// findNestedPromotableLoad - Given an argument that is safe to promote, check
+/// whether the pointer values loaded from it are in turn only loaded, and
+/// whether those loads could also be hoisted into the callers. If so, return
+/// one of the inner loads as a representative, otherwise return null.
+///
+/// This is the question the next iteration over the SCC would ask about the
+/// promoted argument; answering it up front lets both levels be promoted with
+/// a single clone of the function and a single rewrite of its callers.
+static LoadInst *findNestedPromotableLoad(Argument *Arg, AAResults &AAR) {
+  SmallVector<LoadInst *, 16> InnerLoads;
+  for (User *U : Arg->users()) {
+    // GEP+load users would need an inner scalarize table per element; leave
+    // those to the next iteration.
+    LoadInst *LI = dyn_cast<LoadInst>(U);
+    if (!LI || !LI->getType()->isPointerTy())
+      return nullptr;
+    for (User *LU : LI->users()) {
+      LoadInst *Inner = dyn_cast<LoadInst>(LU);
+      // Don't hack volatile/atomic loads
+      if (!Inner || !Inner->isSimple())
+        return nullptr;
+      InnerLoads.push_back(Inner);
+    }
+  }
+
+  if (InnerLoads.empty())
+    return nullptr;
+
+  // Loading through the loaded pointer in the caller is only safe if the
+  // callee does so unconditionally on entry anyway. The outer load has
+  // already been proven safe, and every outer load yields the same pointer
+  // since its memory is not modified before any of them.
+  BasicBlock *EntryBlock = &Arg->getParent()->front();
+  if (none_of(InnerLoads, [&](LoadInst *Inner) {
+        return Inner->getParent() == EntryBlock;
+      }))
+    return nullptr;
+
+  // Check that the pointee is not modified from the entry of the function to
+  // each of the inner loads, exactly as isSafeToPromoteArgument does for the
+  // outer loads.
+  df_iterator_default_set<BasicBlock *, 16> TranspBlocks;
+  for (LoadInst *Inner : InnerLoads) {
+    BasicBlock *BB = Inner->getParent();
+    MemoryLocation Loc = MemoryLocation::get(Inner);
+    if (AAR.canInstructionRangeModRef(BB->front(), *Inner, Loc, MRI_Mod))
+      return nullptr;
+
+    for (BasicBlock *P : predecessors(BB)) {
+      for (BasicBlock *TranspBB : inverse_depth_first_ext(P, TranspBlocks))
+        if (AAR.canBasicBlockModify(*TranspBB, Loc))
+          return nullptr;
+    }
+  }
+
+  return InnerLoads.front();
+}
+
 /// \brief Checks if a type could have padding bytes.
 static bool isDenselyPacked(Type *type, const DataLayout &DL) {
 
@@ -832,6 +937,7 @@ promoteArguments(Function *F, function_ref<AAResults &(Function &F)> AARGetter,
   // add it to ArgsToPromote.
   SmallPtrSet<Argument *, 8> ArgsToPromote;
   SmallPtrSet<Argument *, 8> ByValArgsToTransform;
+  DenseMap<Argument *, LoadInst *> NestedArgsToPromote;
   for (Argument *PtrArg : PointerArgs) {
     Type *AgTy = cast<PointerType>(PtrArg->getType())->getElementType();
 
@@ -902,16 +1008,25 @@ promoteArguments(Function *F, function_ref<AAResults &(Function &F)> AARGetter,
     }
 
     // Otherwise, see if we can promote the pointer to its value.
-    if (isSafeToPromoteArgument(PtrArg, PtrArg->hasByValOrInAllocaAttr(), AAR,
-                                MaxElements))
-      ArgsToPromote.insert(PtrArg);
+    if (!isSafeToPromoteArgument(PtrArg, PtrArg->hasByValOrInAllocaAttr(), AAR,
+                                 MaxElements))
+      continue;
+    ArgsToPromote.insert(PtrArg);
+
+    // See if the promoted value would itself be promotable, so that we can
+    // plan both levels now instead of cloning the function again later. As
+    // with recursive types above, avoid peeling self-recursive functions.
+    if (EnableNestedPromotion && !isSelfRecursive)
+      if (LoadInst *Inner = findNestedPromotableLoad(PtrArg, AAR))
+        NestedArgsToPromote[PtrArg] = Inner;
   }
 
   // No promotable pointer arguments.
   if (ArgsToPromote.empty() && ByValArgsToTransform.empty())
     return nullptr;
 
-  return doPromotion(F, ArgsToPromote, ByValArgsToTransform, ReplaceCallSite);
+  return doPromotion(F, ArgsToPromote, ByValArgsToTransform,
+                     NestedArgsToPromote, ReplaceCallSite);
 }
 
 PreservedAnalyses ArgumentPromotionPass::run(LazyCallGraph::SCC &C,
@@ -0,0 +1,148 @@
+//===- CloneModuleIntoContexts.cpp - Partitioned copies of a module -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements CloneModuleIntoContexts, which makes partitioned copies
+// of a module in separate contexts in parallel. Values cannot be mapped across
+// contexts, so the copies go through bitcode, which is why this lives here
+// rather than next to CloneModule in TransformUtils.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO/CloneModuleIntoContexts.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <vector>
+using namespace llvm;
+
+/// Turn the definitions in M that are not selected by Keep into external
+/// declarations, the same way CloneModule treats definitions it does not clone.
+/// Keep is indexed by the position of each global in M.global_values().
+static void dropUnselectedDefinitions(Module &M, const BitVector &Keep) {
+  SmallVector<GlobalIndirectSymbol *, 4> DroppedIndirectSymbols;
+  unsigned Idx = 0;
+  for (GlobalValue &GV : M.global_values()) {
+    if (Keep[Idx++] || GV.isDeclaration())
+      continue;
+
+    if (auto *F = dyn_cast<Function>(&GV)) {
+      // This also discards a body that has not been materialized yet, and the
+      // personality function, which is not valid on a declaration.
+      F->deleteBody();
+      F->setComdat(nullptr);
+    } else if (auto *Var = dyn_cast<GlobalVariable>(&GV)) {
+      Var->setInitializer(nullptr);
+      Var->setLinkage(GlobalValue::ExternalLinkage);
+      Var->setComdat(nullptr);
+      Var->clearMetadata();
+    } else if (auto *GIS = dyn_cast<GlobalIndirectSymbol>(&GV)) {
+      DroppedIndirectSymbols.push_back(GIS);
+    }
+  }
+
+  // Neither an alias nor an ifunc can act as an external reference, so replace
+  // each with a function or a global variable depending on the value type. An
+  // ifunc always has a function type.
+  for (GlobalIndirectSymbol *GIS : DroppedIndirectSymbols) {
+    GlobalValue *Decl;
+    if (auto *FTy = dyn_cast<FunctionType>(GIS->getValueType()))
+      Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &M);
+    else
+      Decl = new GlobalVariable(
+          M, GIS->getValueType(), false, GlobalValue::ExternalLinkage, nullptr,
+          "", nullptr, GIS->getThreadLocalMode(),
+          GIS->getType()->getAddressSpace());
+    Decl->takeName(GIS);
+    GIS->replaceAllUsesWith(
+        ConstantExpr::getPointerBitCastOrAddrSpaceCast(Decl, GIS->getType()));
+    GIS->eraseFromParent();
+  }
+}
+
+/// Make one copy of M in each of Contexts, where the copy for partition I only
+/// has definitions for the globals that ShouldCloneDefinition(I, GV) selects,
+/// and external declarations for everything else.
+///
+/// Values cannot be mapped between contexts, so M is serialized to bitcode
+/// once, and each copy is then lazily read into its own context on a separate
+/// thread. Only the function bodies a partition keeps are ever read, so each
+/// partition pays for its own definitions only, and the partitions are built
+/// concurrently. M and its context are only used before the threads start.
+///
+/// A context is not thread-safe, so the entries of Contexts must be distinct.
+std::vector<std::unique_ptr<Module>> llvm::CloneModuleIntoContexts(
+    const Module *M, ArrayRef<LLVMContext *> Contexts,
+    function_ref<bool(unsigned, const GlobalValue *)> ShouldCloneDefinition) {
+  unsigned N = Contexts.size();
+  if (N == 0)
+    return {};
+
+#ifndef NDEBUG
+  SmallPtrSet<LLVMContext *, 8> SeenContexts;
+  for (LLVMContext *Context : Contexts)
+    assert(SeenContexts.insert(Context).second &&
+           "Each partition needs a context of its own");
+#endif
+
+  // Record which definitions go to each partition, by position in the list of
+  // global values. Reading the bitcode back preserves that order.
+  std::vector<BitVector> Keep(N);
+  unsigned NumGlobals =
+      M->size() + M->global_size() + M->alias_size() + M->ifunc_size();
+  for (unsigned I = 0; I != N; ++I) {
+    Keep[I].resize(NumGlobals);
+    unsigned Idx = 0;
+    for (const GlobalValue &GV : M->global_values()) {
+      if (ShouldCloneDefinition(I, &GV))
+        Keep[I].set(Idx);
+      ++Idx;
+    }
+  }
+
+  SmallString<0> BC;
+  {
+    raw_svector_ostream BCOS(BC);
+    WriteBitcodeToFile(M, BCOS);
+  }
+  MemoryBufferRef Buffer(StringRef(BC.data(), BC.size()),
+                         M->getModuleIdentifier());
+
+  std::vector<std::unique_ptr<Module>> Clones(N);
+  {
+    ThreadPool Pool(std::min(N, heavyweight_hardware_concurrency()));
+    for (unsigned I = 0; I != N; ++I)
+      Pool.async([&, I] {
+        std::unique_ptr<Module> Clone =
+            cantFail(getLazyBitcodeModule(Buffer, *Contexts[I]));
+        dropUnselectedDefinitions(*Clone, Keep[I]);
+        cantFail(Clone->materializeAll());
+        Clones[I] = std::move(Clone);
+      });
+    Pool.wait();
+  }
+
+  return Clones;
+}
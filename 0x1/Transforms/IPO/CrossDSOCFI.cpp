@@ -10,6 +10,10 @@
 // This pass exports all llvm.bitset's found in the module in the form of a
 // __cfi_check function, which can be used to verify cross-DSO call targets.
 //
+// Optionally, it also puts a single-entry inline cache in front of each call to
+// __cfi_slowpath in the module, which skips the runtime lookup and the call to
+// the target DSO's __cfi_check when the call site sees the same target again.
+//
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/IPO/CrossDSOCFI.h"
@@ -28,6 +32,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Operator.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO.h"
@@ -38,6 +43,14 @@ using namespace llvm;
 #define DEBUG_TYPE "cross-dso-cfi"
 
 STATISTIC(NumTypeIds, "Number of unique type identifiers");
+STATISTIC(NumInlineCaches, "Number of slow path checks given an inline cache");
+
+// The cache lives in writable memory and is not invalidated when a DSO is
+// unloaded, so it trades some of the guarantees of the check for speed.
+static cl::opt<bool> ClInlineCache(
+    "cross-dso-cfi-inline-cache",
+    cl::desc("Cache the last validated target of each cross-DSO CFI check"),
+    cl::Hidden, cl::init(false));
 
 namespace {
 
@@ -51,6 +64,7 @@ struct CrossDSOCFI : public ModulePass {
 
   ConstantInt *extractNumericTypeId(MDNode *MD);
   void buildCFICheck(Module &M);
+  void buildInlineCaches(Module &M);
   bool runOnModule(Module &M) override;
 };
 
@@ -146,6 +160,59 @@ void CrossDSOCFI::buildCFICheck(Module &M) {
   }
 }
 
+/// buildInlineCaches - guards each call to __cfi_slowpath in the current module
+/// with a per-call-site cache of the last target it validated.
+void CrossDSOCFI::buildInlineCaches(Module &M) {
+  // Only __cfi_slowpath traps when the check fails, so a target that makes it
+  // past the call is known to be valid. __cfi_slowpath_diag may return after
+  // reporting a bad target, which must not be cached.
+  Function *SlowPathFn = M.getFunction("__cfi_slowpath");
+  if (!SlowPathFn)
+    return;
+
+  SmallVector<CallInst *, 16> SlowPathCalls;
+  for (User *U : SlowPathFn->users())
+    if (auto *CI = dyn_cast<CallInst>(U))
+      if (CI->getCalledValue() == SlowPathFn && CI->getNumArgOperands() == 2 &&
+          isa<ConstantInt>(CI->getArgOperand(0)))
+        SlowPathCalls.push_back(CI);
+
+  LLVMContext &Ctx = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+  unsigned CacheAlign = DL.getABITypeAlignment(Int8PtrTy);
+  MDNode *VeryUnlikelyWeights =
+      MDBuilder(Ctx).createBranchWeights(1, (1U << 20) - 1);
+
+  // No function lives at the all-ones address, so an empty cache never hits.
+  Constant *EmptyCache =
+      ConstantExpr::getIntToPtr(Constant::getAllOnesValue(DL.getIntPtrType(Ctx)),
+                                Int8PtrTy);
+
+  for (CallInst *CI : SlowPathCalls) {
+    // The type identifier is a constant at each call site, so caching the
+    // target alone identifies the validated (target, type id) pair.
+    Value *Addr = CI->getArgOperand(1);
+    auto *Cache = new GlobalVariable(M, Int8PtrTy, /*isConstant=*/false,
+                                     GlobalValue::PrivateLinkage, EmptyCache,
+                                     "__cfi_slowpath_cache");
+    Cache->setAlignment(CacheAlign);
+
+    IRBuilder<> IRB(CI);
+    LoadInst *Cached = IRB.CreateAlignedLoad(Cache, CacheAlign);
+    Cached->setAtomic(AtomicOrdering::Monotonic);
+    Value *Miss = IRB.CreateICmpNE(Cached, Addr);
+    TerminatorInst *MissTerm = SplitBlockAndInsertIfThen(
+        Miss, CI, /*Unreachable=*/false, VeryUnlikelyWeights);
+    CI->moveBefore(MissTerm);
+
+    IRBuilder<> IRBMiss(MissTerm);
+    StoreInst *Update = IRBMiss.CreateAlignedStore(Addr, Cache, CacheAlign);
+    Update->setAtomic(AtomicOrdering::Monotonic);
+    ++NumInlineCaches;
+  }
+}
+
 bool CrossDSOCFI::runOnModule(Module &M) {
   if (skipModule(M))
     return false;
@@ -155,6 +222,8 @@ bool CrossDSOCFI::runOnModule(Module &M) {
   if (M.getModuleFlag("Cross-DSO CFI") == nullptr)
     return false;
   buildCFICheck(M);
+  if (ClInlineCache)
+    buildInlineCaches(M);
   return true;
 }
 
@@ -17,6 +17,7 @@
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/Triple.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
@@ -30,6 +31,7 @@
 #include "llvm/IR/ModuleSummaryIndexYAML.h"
 #include "llvm/IR/Operator.h"
 #include "llvm/Pass.h"
+#include "llvm/ProfileData/InstrProf.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
@@ -38,6 +40,7 @@
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <numeric>
 
 using namespace llvm;
 using namespace lowertypetests;
@@ -55,6 +58,12 @@ static cl::opt<bool> AvoidReuse(
     cl::desc("Try to avoid reuse of byte array addresses using aliases"),
     cl::Hidden, cl::init(true));
 
+static cl::opt<bool> HotLayout(
+    "lowertypetests-hot-layout",
+    cl::desc("Use profile data to place the members and bit sets of "
+             "frequently tested type identifiers next to each other"),
+    cl::Hidden, cl::init(false));
+
 static cl::opt<PassSummaryAction> ClSummaryAction(
     "lowertypetests-summary-action",
     cl::desc("What to do with the summary when running this pass"),
@@ -194,6 +203,7 @@ namespace {
 struct ByteArrayInfo {
   std::set<uint64_t> Bits;
   uint64_t BitSize;
+  uint64_t Count;
   GlobalVariable *ByteArray;
   GlobalVariable *MaskGlobal;
 };
@@ -257,6 +267,9 @@ class LowerTypeTestsModule {
   struct TypeIdUserInfo {
     std::vector<CallInst *> CallSites;
     bool IsExported = false;
+    /// With -lowertypetests-hot-layout, the profiled number of times the call
+    /// sites above are executed.
+    uint64_t Count = 0;
   };
   DenseMap<Metadata *, TypeIdUserInfo> TypeIdUsers;
 
@@ -299,7 +312,7 @@ class LowerTypeTestsModule {
   BitSetInfo
   buildBitSet(Metadata *TypeId,
               const DenseMap<GlobalTypeMember *, uint64_t> &GlobalLayout);
-  ByteArrayInfo *createByteArray(BitSetInfo &BSI);
+  ByteArrayInfo *createByteArray(BitSetInfo &BSI, uint64_t Count);
   void allocateByteArrays();
   Value *createBitSetTest(IRBuilder<> &B, const TypeIdLowering &TIL,
                           Value *BitOffset);
@@ -420,7 +433,8 @@ static Value *createMaskedBitTest(IRBuilder<> &B, Value *Bits,
   return B.CreateICmpNE(MaskedBits, ConstantInt::get(BitsType, 0));
 }
 
-ByteArrayInfo *LowerTypeTestsModule::createByteArray(BitSetInfo &BSI) {
+ByteArrayInfo *LowerTypeTestsModule::createByteArray(BitSetInfo &BSI,
+                                                     uint64_t Count) {
   // Create globals to stand in for byte arrays and masks. These never actually
   // get initialized, we RAUW and erase them later in allocateByteArrays() once
   // we know the offset and mask to use.
@@ -434,14 +448,22 @@ ByteArrayInfo *LowerTypeTestsModule::createByteArray(BitSetInfo &BSI) {
 
   BAI->Bits = BSI.Bits;
   BAI->BitSize = BSI.BitSize;
+  BAI->Count = Count;
   BAI->ByteArray = ByteArrayGlobal;
   BAI->MaskGlobal = MaskGlobal;
   return BAI;
 }
 
 void LowerTypeTestsModule::allocateByteArrays() {
+  // Byte arrays are allocated at the lowest offset of the least used bit, so
+  // the arrays allocated first share the first bytes of the combined array. In
+  // hot layout mode, give those slots to the most frequently tested arrays so
+  // that hot checks load from the same few cache lines; arrays without profile
+  // data are still ordered by size for the best packing.
   std::stable_sort(ByteArrayInfos.begin(), ByteArrayInfos.end(),
                    [](const ByteArrayInfo &BAI1, const ByteArrayInfo &BAI2) {
+                     if (HotLayout && BAI1.Count != BAI2.Count)
+                       return BAI1.Count > BAI2.Count;
                      return BAI1.BitSize > BAI2.BitSize;
                    });
 
@@ -850,7 +872,7 @@ void LowerTypeTestsModule::lowerTypeTestCalls(
     } else {
       TIL.TheKind = TypeTestResolution::ByteArray;
       ++NumByteArraysCreated;
-      ByteArrayInfo *BAI = createByteArray(BSI);
+      ByteArrayInfo *BAI = createByteArray(BSI, TypeIdUsers[TypeId].Count);
       TIL.TheByteArray = BAI->ByteArray;
       TIL.BitMask = BAI->MaskGlobal;
     }
@@ -1261,13 +1283,37 @@ void LowerTypeTestsModule::buildBitSetsFromDisjointSet(
   for (auto &&MemSet : TypeMembers)
     GLB.addFragment(MemSet);
 
+  // Lay out the fragments in the order they were built, or, in hot layout
+  // mode, in decreasing order of how often the hottest type identifier among
+  // their members is tested. All members of a type identifier end up in the
+  // same fragment, so this keeps members of hot type identifiers together at
+  // the start of the combined global, and their bit sets next to each other.
+  std::vector<unsigned> FragmentOrder(GLB.Fragments.size());
+  std::iota(FragmentOrder.begin(), FragmentOrder.end(), 0);
+  if (HotLayout) {
+    std::vector<uint64_t> FragmentCounts(GLB.Fragments.size());
+    GlobalIndex = 0;
+    for (GlobalTypeMember *GTM : Globals) {
+      uint64_t &FragmentCount = FragmentCounts[GLB.FragmentMap[GlobalIndex++]];
+      for (MDNode *Type : GTM->types()) {
+        auto I = TypeIdUsers.find(Type->getOperand(1));
+        if (I != TypeIdUsers.end())
+          FragmentCount = std::max(FragmentCount, I->second.Count);
+      }
+    }
+    std::stable_sort(FragmentOrder.begin(), FragmentOrder.end(),
+                     [&](unsigned F1, unsigned F2) {
+                       return FragmentCounts[F1] > FragmentCounts[F2];
+                     });
+  }
+
   // Build the bitsets from this disjoint set.
   if (Globals.empty() || isa<GlobalVariable>(Globals[0]->getGlobal())) {
     // Build a vector of global variables with the computed layout.
     std::vector<GlobalTypeMember *> OrderedGVs(Globals.size());
     auto OGI = OrderedGVs.begin();
-    for (auto &&F : GLB.Fragments) {
-      for (auto &&Offset : F) {
+    for (unsigned FI : FragmentOrder) {
+      for (auto &&Offset : GLB.Fragments[FI]) {
         auto GV = dyn_cast<GlobalVariable>(Globals[Offset]->getGlobal());
         if (!GV)
           report_fatal_error("Type identifier may not contain both global "
@@ -1281,8 +1327,8 @@ void LowerTypeTestsModule::buildBitSetsFromDisjointSet(
     // Build a vector of functions with the computed layout.
     std::vector<GlobalTypeMember *> OrderedFns(Globals.size());
     auto OFI = OrderedFns.begin();
-    for (auto &&F : GLB.Fragments) {
-      for (auto &&Offset : F) {
+    for (unsigned FI : FragmentOrder) {
+      for (auto &&Offset : GLB.Fragments[FI]) {
         auto Fn = dyn_cast<Function>(Globals[Offset]->getGlobal());
         if (!Fn)
           report_fatal_error("Type identifier may not contain both global "
@@ -1295,6 +1341,31 @@ void LowerTypeTestsModule::buildBitSetsFromDisjointSet(
   }
 }
 
+/// Estimate how many times the type test CI is executed. Prefer the value
+/// profile of the indirect call that it guards, which is what indirect call
+/// promotion uses, and fall back to the entry count of the enclosing function.
+static uint64_t getTypeTestCount(CallInst *CI) {
+  Value *Ptr = CI->getArgOperand(0)->stripPointerCasts();
+  if (!isa<Constant>(Ptr)) {
+    for (User *U : Ptr->users()) {
+      CallSite CS(U);
+      if (!CS || CS.getCalledValue()->stripPointerCasts() != Ptr)
+        continue;
+      InstrProfValueData ValueData;
+      uint32_t NumVals;
+      uint64_t TotalCount;
+      if (getValueProfDataFromInst(*CS.getInstruction(),
+                                   IPVK_IndirectCallTarget, 1, &ValueData,
+                                   NumVals, TotalCount))
+        return TotalCount;
+    }
+  }
+
+  if (Optional<uint64_t> EntryCount = CI->getFunction()->getEntryCount())
+    return *EntryCount;
+  return 0;
+}
+
 /// Lower all type tests in this module.
 LowerTypeTestsModule::LowerTypeTestsModule(
     Module &M, ModuleSummaryIndex *ExportSummary,
@@ -1427,7 +1498,10 @@ bool LowerTypeTestsModule::lower() {
       if (!TypeIdMDVal)
         report_fatal_error("Second argument of llvm.type.test must be metadata");
       auto TypeId = TypeIdMDVal->getMetadata();
-      AddTypeIdUse(TypeId).CallSites.push_back(CI);
+      TypeIdUserInfo &TIUI = AddTypeIdUse(TypeId);
+      TIUI.CallSites.push_back(CI);
+      if (HotLayout)
+        TIUI.Count = SaturatingAdd(TIUI.Count, getTypeTestCount(CI));
     }
   }
 
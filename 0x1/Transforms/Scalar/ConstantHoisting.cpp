@@ -37,6 +37,7 @@
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Pass.h"
@@ -52,6 +53,11 @@ using namespace consthoist;
 
 STATISTIC(NumConstantsHoisted, "Number of constants hoisted");
 STATISTIC(NumConstantsRebased, "Number of constants rebased");
+STATISTIC(NumMaterializationsSaved,
+          "Number of constant materializations removed");
+STATISTIC(NumDynMaterializationsSaved,
+          "Estimated constant materializations removed per function "
+          "invocation, by block frequency");
 
 static cl::opt<bool> ConstHoistWithBlockFrequency(
     "consthoist-with-block-frequency", cl::init(false), cl::Hidden,
@@ -59,6 +65,23 @@ static cl::opt<bool> ConstHoistWithBlockFrequency(
              "chance to execute const materialization more frequently than "
              "without hoisting."));
 
+// After LTO inlining, the expensive constants of a whole call tree end up in a
+// few hot functions, where the default placement at the nearest common
+// dominator can sit on a hotter path than the uses themselves.
+static cl::opt<bool> ConstHoistHotFunctions(
+    "consthoist-hot-functions", cl::init(false), cl::Hidden,
+    cl::desc("Use block frequency to place hoisted constants in functions "
+             "that the profile summary says are hot"));
+
+/// Return true if the block frequency should be used to place the constants
+/// hoisted in \p F.
+static bool useBlockFrequency(const Function &F, ProfileSummaryInfo *PSI) {
+  if (ConstHoistWithBlockFrequency)
+    return true;
+  return ConstHoistHotFunctions && PSI && PSI->hasProfileSummary() &&
+         PSI->isFunctionEntryHot(&F);
+}
+
 namespace {
 /// \brief The constant hoisting pass.
 class ConstantHoistingLegacyPass : public FunctionPass {
@@ -74,8 +97,10 @@ public:
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.setPreservesCFG();
-    if (ConstHoistWithBlockFrequency)
+    if (ConstHoistWithBlockFrequency || ConstHoistHotFunctions)
       AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    if (ConstHoistHotFunctions)
+      AU.addRequired<ProfileSummaryInfoWrapperPass>();
     AU.addRequired<DominatorTreeWrapperPass>();
     AU.addRequired<TargetTransformInfoWrapperPass>();
   }
@@ -92,6 +117,7 @@ INITIALIZE_PASS_BEGIN(ConstantHoistingLegacyPass, "consthoist",
                       "Constant Hoisting", false, false)
 INITIALIZE_PASS_DEPENDENCY(BlockFrequencyInfoWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(ProfileSummaryInfoWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(TargetTransformInfoWrapperPass)
 INITIALIZE_PASS_END(ConstantHoistingLegacyPass, "consthoist",
                     "Constant Hoisting", false, false)
@@ -108,10 +134,14 @@ bool ConstantHoistingLegacyPass::runOnFunction(Function &Fn) {
   DEBUG(dbgs() << "********** Begin Constant Hoisting **********\n");
   DEBUG(dbgs() << "********** Function: " << Fn.getName() << '\n');
 
+  ProfileSummaryInfo *PSI =
+      ConstHoistHotFunctions
+          ? getAnalysis<ProfileSummaryInfoWrapperPass>().getPSI()
+          : nullptr;
   bool MadeChange =
       Impl.runImpl(Fn, getAnalysis<TargetTransformInfoWrapperPass>().getTTI(Fn),
                    getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
-                   ConstHoistWithBlockFrequency
+                   useBlockFrequency(Fn, PSI)
                        ? &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI()
                        : nullptr,
                    Fn.getEntryBlock());
@@ -684,7 +714,24 @@ bool ConstantHoistingPass::emitBaseConstants() {
 
     unsigned UsesNum = 0;
     unsigned ReBasesNum = 0;
+    // Every use of the base constant itself used to materialize it; now only
+    // the hoisted copies do.
+    unsigned BaseUses = 0;
+    uint64_t BaseUseFreq = 0, HoistedFreq = 0;
+    for (auto const &RCI : ConstInfo.RebasedConstants) {
+      if (RCI.Offset)
+        continue;
+      for (auto const &U : RCI.Uses) {
+        BaseUses++;
+        if (BFI)
+          BaseUseFreq +=
+              BFI->getBlockFreq(findMatInsertPt(U.Inst, U.OpndIdx)->getParent())
+                  .getFrequency();
+      }
+    }
     for (Instruction *IP : IPSet) {
+      if (BFI)
+        HoistedFreq += BFI->getBlockFreq(IP->getParent()).getFrequency();
       IntegerType *Ty = ConstInfo.BaseConstant->getType();
       Instruction *Base =
           new BitCastInst(ConstInfo.BaseConstant, Ty, "const", IP);
@@ -725,7 +772,13 @@ bool ConstantHoistingPass::emitBaseConstants() {
 
     // Base constant is also included in ConstInfo.RebasedConstants, so
     // deduct 1 from ConstInfo.RebasedConstants.size().
-    NumConstantsRebased = ConstInfo.RebasedConstants.size() - 1;
+    NumConstantsRebased += ConstInfo.RebasedConstants.size() - 1;
+
+    if (BaseUses > IPSet.size())
+      NumMaterializationsSaved += BaseUses - IPSet.size();
+    uint64_t EntryFreq = BFI ? BFI->getEntryFreq() : 0;
+    if (EntryFreq && BaseUseFreq > HoistedFreq)
+      NumDynMaterializationsSaved += (BaseUseFreq - HoistedFreq) / EntryFreq;
 
     MadeChange = true;
   }
@@ -777,7 +830,12 @@ PreservedAnalyses ConstantHoistingPass::run(Function &F,
                                             FunctionAnalysisManager &AM) {
   auto &DT = AM.getResult<DominatorTreeAnalysis>(F);
   auto &TTI = AM.getResult<TargetIRAnalysis>(F);
-  auto BFI = ConstHoistWithBlockFrequency
+  ProfileSummaryInfo *PSI =
+      ConstHoistHotFunctions
+          ? AM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+                .getCachedResult<ProfileSummaryAnalysis>(*F.getParent())
+          : nullptr;
+  auto BFI = useBlockFrequency(F, PSI)
                  ? &AM.getResult<BlockFrequencyAnalysis>(F)
                  : nullptr;
   if (!runImpl(F, TTI, DT, BFI, F.getEntryBlock()))
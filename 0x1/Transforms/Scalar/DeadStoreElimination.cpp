@@ -21,10 +21,12 @@
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/Analysis/GlobalsModRef.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Constants.h"
@@ -49,12 +51,24 @@ STATISTIC(NumRedundantStores, "Number of redundant stores deleted");
 STATISTIC(NumFastStores, "Number of stores deleted");
 STATISTIC(NumFastOther , "Number of other instrs removed");
 STATISTIC(NumCompletePartials, "Number of stores dead by later partials");
+STATISTIC(NumCrossBlockStores,
+          "Number of stores overwritten on all paths through later blocks");
 
 static cl::opt<bool>
 EnablePartialOverwriteTracking("enable-dse-partial-overwrite-tracking",
   cl::init(true), cl::Hidden,
   cl::desc("Enable partial-overwrite tracking in DSE"));
 
+static cl::opt<bool>
+EnableDSEMemorySSA("enable-dse-memoryssa", cl::init(false), cl::Hidden,
+  cl::desc("Use MemorySSA to find stores that are overwritten on every path "
+           "through later blocks"));
+
+static cl::opt<unsigned>
+MemorySSAScanLimit("dse-memoryssa-scanlimit", cl::init(150), cl::Hidden,
+  cl::desc("The number of memory accesses and blocks to look at per store "
+           "when looking for overwrites in later blocks"));
+
 
 //===----------------------------------------------------------------------===//
 // Helper functions
@@ -1157,10 +1171,200 @@ static bool eliminateDeadStores(BasicBlock &BB, AliasAnalysis *AA,
   return MadeChange;
 }
 
+namespace {
+/// Checks whether a store is overwritten on every path from it to the end of
+/// the function, before anything can read the location it writes. Blocks are
+/// scanned through their MemorySSA access lists, so instructions that don't
+/// touch memory are never looked at, and blocks that don't touch memory at
+/// all are passed straight through.
+///
+/// Blocks from which the store's block may be reached again are not entered:
+/// once the path has gone around a cycle, the store's pointer may refer to a
+/// different address, and alias analysis only answers queries within one
+/// iteration.
+class AllPathsOverwriteChecker {
+  Instruction *Store;
+  MemoryLocation Loc;
+  /// True if the underlying object is dead once the function returns or
+  /// unwinds, so that reaching an exit also kills the store.
+  bool IsDeadAtExit;
+  MemorySSA &MSSA;
+  AliasAnalysis &AA;
+  const DominatorTree &DT;
+  const DataLayout &DL;
+  const TargetLibraryInfo &TLI;
+  unsigned Budget;
+
+  /// Blocks whose entry has been looked at. The value is true while the block
+  /// is still on the DFS stack, and false once every path from its entry is
+  /// known to kill the store.
+  DenseMap<BasicBlock *, bool> Visiting;
+  DenseMap<BasicBlock *, bool> MayThrow;
+
+  enum ScanResult { SR_Killed, SR_Read, SR_FallThrough };
+
+  bool blockMayThrow(BasicBlock *BB) {
+    auto Ins = MayThrow.insert(std::make_pair(BB, false));
+    if (Ins.second)
+      Ins.first->second =
+          any_of(*BB, [](Instruction &I) { return I.mayThrow(); });
+    return Ins.first->second;
+  }
+
+  /// Scan the memory accesses of BB, starting after the store if StartAtStore
+  /// is set, for the first one that reads or completely overwrites Loc.
+  ScanResult scanBlock(BasicBlock *BB, bool StartAtStore) {
+    // An exception may leave the function before the store is overwritten.
+    if (!IsDeadAtExit && blockMayThrow(BB))
+      return SR_Read;
+
+    const MemorySSA::AccessList *Accesses = MSSA.getBlockAccesses(BB);
+    if (!Accesses)
+      return SR_FallThrough;
+
+    bool Started = !StartAtStore;
+    for (const MemoryAccess &MA : *Accesses) {
+      const auto *MUD = dyn_cast<MemoryUseOrDef>(&MA);
+      if (!MUD)
+        continue;
+      Instruction *I = MUD->getMemoryInst();
+      if (!Started) {
+        Started = I == Store;
+        continue;
+      }
+
+      if (!Budget)
+        return SR_Read;
+      --Budget;
+
+      if (AA.getModRefInfo(I, Loc) & MRI_Ref)
+        return SR_Read;
+
+      if (!isa<MemoryDef>(MUD) || !hasMemoryWrite(I, TLI))
+        continue;
+      MemoryLocation Later = getLocForWrite(I, AA);
+      if (!Later.Ptr)
+        continue;
+      // Partial overwrites seen along different paths must not be combined,
+      // so don't share the interval map between queries.
+      InstOverlapIntervalsTy IOL;
+      int64_t EarlierOff = 0, LaterOff = 0;
+      if (isOverwrite(Later, Loc, DL, TLI, EarlierOff, LaterOff, Store, IOL) ==
+          OW_Complete)
+        return SR_Killed;
+    }
+    return SR_FallThrough;
+  }
+
+  bool allSuccessorsKill(BasicBlock *BB) {
+    TerminatorInst *TI = BB->getTerminator();
+    if (!TI->getNumSuccessors())
+      return IsDeadAtExit;
+    for (BasicBlock *Succ : TI->successors())
+      if (!entryKills(Succ))
+        return false;
+    return true;
+  }
+
+  bool entryKills(BasicBlock *BB) {
+    auto It = Visiting.find(BB);
+    if (It != Visiting.end())
+      return !It->second;
+    if (!Budget)
+      return false;
+    --Budget;
+
+    // Give up on anything inside a cycle through the store, not just on the
+    // blocks that are on the DFS stack: a loop header reached along a path
+    // that hasn't come round its backedge yet may recompute the pointer.
+    if (isPotentiallyReachable(BB, Store->getParent(), &DT))
+      return false;
+
+    Visiting[BB] = true;
+    ScanResult R = scanBlock(BB, /*StartAtStore=*/false);
+    if (R == SR_Read || (R == SR_FallThrough && !allSuccessorsKill(BB)))
+      return false;
+    Visiting[BB] = false;
+    return true;
+  }
+
+public:
+  AllPathsOverwriteChecker(Instruction *Store, const MemoryLocation &Loc,
+                           bool IsDeadAtExit, MemorySSA &MSSA,
+                           AliasAnalysis &AA, const DominatorTree &DT,
+                           const DataLayout &DL, const TargetLibraryInfo &TLI)
+      : Store(Store), Loc(Loc), IsDeadAtExit(IsDeadAtExit), MSSA(MSSA), AA(AA),
+        DT(DT), DL(DL), TLI(TLI), Budget(MemorySSAScanLimit) {}
+
+  bool isDead() {
+    ScanResult R = scanBlock(Store->getParent(), /*StartAtStore=*/true);
+    if (R != SR_FallThrough)
+      return R == SR_Killed;
+    return allSuccessorsKill(Store->getParent());
+  }
+};
+} // end anonymous namespace
+
+/// Delete stores that are overwritten on every path through later blocks, or
+/// that are to objects which die at the end of the function, before anything
+/// reads them. The per-block scan only sees overwrites within one block.
+static bool eliminateDeadStoresAcrossBlocks(Function &F, AliasAnalysis *AA,
+                                            MemorySSA *MSSA,
+                                            MemoryDependenceResults *MD,
+                                            DominatorTree *DT,
+                                            const TargetLibraryInfo *TLI) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  SmallVector<Instruction *, 16> DeadStores;
+
+  for (BasicBlock &BB : F) {
+    if (!DT->isReachableFromEntry(&BB) || !MSSA->getBlockAccesses(&BB))
+      continue;
+    for (Instruction &I : BB) {
+      if (!hasMemoryWrite(&I, *TLI) || !isRemovable(&I) ||
+          !MSSA->getMemoryAccess(&I))
+        continue;
+      MemoryLocation Loc = getLocForWrite(&I, *AA);
+      if (!Loc.Ptr || Loc.Size == MemoryLocation::UnknownSize)
+        continue;
+
+      const Value *Obj = GetUnderlyingObject(Loc.Ptr, DL);
+      bool IsDeadAtExit = isa<AllocaInst>(Obj);
+      if (auto *A = dyn_cast<Argument>(Obj))
+        IsDeadAtExit = A->hasByValOrInAllocaAttr();
+      else if (isAllocLikeFn(Obj, TLI))
+        IsDeadAtExit = !PointerMayBeCaptured(Obj, true, true);
+
+      if (AllPathsOverwriteChecker(&I, Loc, IsDeadAtExit, *MSSA, *AA, *DT, DL,
+                                   *TLI).isDead())
+        DeadStores.push_back(&I);
+    }
+  }
+
+  if (DeadStores.empty())
+    return false;
+
+  // Deleting one of these stores can't make another one live: whatever killed
+  // the deleted store also completely overwrites anything it killed.
+  InstOverlapIntervalsTy IOL;
+  DenseMap<Instruction *, size_t> InstrOrdering;
+  for (Instruction *I : DeadStores) {
+    DEBUG(dbgs() << "DSE: Cross-block dead store:\n  DEAD: " << *I << '\n');
+    BasicBlock::iterator BBI(I);
+    deleteDeadInstruction(I, &BBI, *MD, *TLI, IOL, &InstrOrdering);
+    ++NumCrossBlockStores;
+  }
+  return true;
+}
+
 static bool eliminateDeadStores(Function &F, AliasAnalysis *AA,
                                 MemoryDependenceResults *MD, DominatorTree *DT,
-                                const TargetLibraryInfo *TLI) {
+                                const TargetLibraryInfo *TLI,
+                                MemorySSA *MSSA) {
   bool MadeChange = false;
+  // This has to come first: MemorySSA isn't kept up to date by the per-block
+  // scan, while memdep is updated by both.
+  if (MSSA)
+    MadeChange |= eliminateDeadStoresAcrossBlocks(F, AA, MSSA, MD, DT, TLI);
   for (BasicBlock &BB : F)
     // Only check non-dead blocks.  Dead blocks may have strange pointer
     // cycles that will confuse alias analysis.
@@ -1178,8 +1382,11 @@ PreservedAnalyses DSEPass::run(Function &F, FunctionAnalysisManager &AM) {
   DominatorTree *DT = &AM.getResult<DominatorTreeAnalysis>(F);
   MemoryDependenceResults *MD = &AM.getResult<MemoryDependenceAnalysis>(F);
   const TargetLibraryInfo *TLI = &AM.getResult<TargetLibraryAnalysis>(F);
+  MemorySSA *MSSA = EnableDSEMemorySSA
+                        ? &AM.getResult<MemorySSAAnalysis>(F).getMSSA()
+                        : nullptr;
 
-  if (!eliminateDeadStores(F, AA, MD, DT, TLI))
+  if (!eliminateDeadStores(F, AA, MD, DT, TLI, MSSA))
     return PreservedAnalyses::all();
 
   PreservedAnalyses PA;
@@ -1207,8 +1414,12 @@ public:
         &getAnalysis<MemoryDependenceWrapperPass>().getMemDep();
     const TargetLibraryInfo *TLI =
         &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+    MemorySSA *MSSA =
+        EnableDSEMemorySSA
+            ? &getAnalysis<MemorySSAWrapperPass>().getMSSA()
+            : nullptr;
 
-    return eliminateDeadStores(F, AA, MD, DT, TLI);
+    return eliminateDeadStores(F, AA, MD, DT, TLI, MSSA);
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
@@ -1217,6 +1428,8 @@ public:
     AU.addRequired<AAResultsWrapperPass>();
     AU.addRequired<MemoryDependenceWrapperPass>();
     AU.addRequired<TargetLibraryInfoWrapperPass>();
+    if (EnableDSEMemorySSA)
+      AU.addRequired<MemorySSAWrapperPass>();
     AU.addPreserved<DominatorTreeWrapperPass>();
     AU.addPreserved<GlobalsAAWrapperPass>();
     AU.addPreserved<MemoryDependenceWrapperPass>();
@@ -1233,6 +1446,7 @@ INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(AAResultsWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(GlobalsAAWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(MemoryDependenceWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(MemorySSAWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfoWrapperPass)
 INITIALIZE_PASS_END(DSELegacyPass, "dse", "Dead Store Elimination", false,
                     false)
@@ -308,7 +308,12 @@ public:
   /// values.
   ///
   /// It uses the same generation count as loads.
-  typedef ScopedHashTable<CallValue, std::pair<Instruction *, unsigned>>
+  typedef RecyclingAllocator<
+      BumpPtrAllocator,
+      ScopedHashTableVal<CallValue, std::pair<Instruction *, unsigned>>>
+      CallMapAllocator;
+  typedef ScopedHashTable<CallValue, std::pair<Instruction *, unsigned>,
+                          DenseMapInfo<CallValue>, CallMapAllocator>
       CallHTType;
   CallHTType AvailableCalls;
 
@@ -387,6 +392,25 @@ private:
     bool Processed;
   };
 
+  /// \brief Allocator for the dominator tree walk's stack nodes.
+  ///
+  /// A node is pushed for every dominator tree node, so rather than going to
+  /// the heap each time they are carved out of an arena owned by this runner.
+  /// Popped nodes are recycled, so the arena only grows with the depth of the
+  /// tree, and it is released in one go when the runner is destroyed.
+  RecyclingAllocator<BumpPtrAllocator, StackNode> StackNodeAllocator;
+
+  StackNode *createStackNode(unsigned Generation, DomTreeNode *N) {
+    return new (StackNodeAllocator.Allocate())
+        StackNode(AvailableValues, AvailableLoads, AvailableCalls, Generation,
+                  N, N->begin(), N->end());
+  }
+
+  void destroyStackNode(StackNode *N) {
+    N->~StackNode();
+    StackNodeAllocator.Deallocate(N);
+  }
+
   /// \brief Wrapper class to handle memory instructions, including loads,
   /// stores and intrinsic loads and stores defined by the target.
   class ParseMemoryInst {
@@ -933,9 +957,8 @@ bool EarlyCSE::run() {
   bool Changed = false;
 
   // Process the root node.
-  nodesToProcess.push_back(new StackNode(
-      AvailableValues, AvailableLoads, AvailableCalls, CurrentGeneration,
-      DT.getRootNode(), DT.getRootNode()->begin(), DT.getRootNode()->end()));
+  nodesToProcess.push_back(
+      createStackNode(CurrentGeneration, DT.getRootNode()));
 
   // Save the current generation.
   unsigned LiveOutGeneration = CurrentGeneration;
@@ -959,13 +982,11 @@ bool EarlyCSE::run() {
       // Push the next child onto the stack.
       DomTreeNode *child = NodeToProcess->nextChild();
       nodesToProcess.push_back(
-          new StackNode(AvailableValues, AvailableLoads, AvailableCalls,
-                        NodeToProcess->childGeneration(), child, child->begin(),
-                        child->end()));
+          createStackNode(NodeToProcess->childGeneration(), child));
     } else {
       // It has been processed, and there are no more children to process,
       // so delete it and pop it off the stack.
-      delete NodeToProcess;
+      destroyStackNode(NodeToProcess);
       nodesToProcess.pop_back();
     }
   } // while (!nodes...)
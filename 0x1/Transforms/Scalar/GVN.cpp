@@ -33,6 +33,8 @@
 #include "llvm/Analysis/Loads.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
 #include "llvm/Analysis/OptimizationDiagnosticInfo.h"
 #include "llvm/Analysis/PHITransAddr.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
@@ -67,16 +69,35 @@ STATISTIC(NumGVNBlocks, "Number of blocks merged");
 STATISTIC(NumGVNSimpl,  "Number of instructions simplified");
 STATISTIC(NumGVNEqProp, "Number of equalities propagated");
 STATISTIC(NumPRELoad,   "Number of loads PRE'd");
+STATISTIC(NumMSSALoad,  "Number of loads deleted using MemorySSA");
+STATISTIC(NumNonLocalLoadQueries, "Number of non-local load dependency queries");
+STATISTIC(NumNonLocalLoadTooManyDeps,
+          "Number of non-local loads given up on for too many dependencies");
 
 static cl::opt<bool> EnablePRE("enable-pre",
                                cl::init(true), cl::Hidden);
 static cl::opt<bool> EnableLoadPRE("enable-load-pre", cl::init(true));
+static cl::opt<bool> EnableMSSALoadElim(
+    "enable-gvn-memssa", cl::init(false), cl::Hidden,
+    cl::desc("Eliminate fully redundant loads using MemorySSA before the "
+             "MemoryDependenceAnalysis based load elimination"));
+static cl::opt<unsigned> MSSALoadElimScanLimit(
+    "gvn-memssa-scan-limit", cl::init(16), cl::Hidden,
+    cl::desc("Max number of earlier accesses of the same pointer considered "
+             "for each load by MemorySSA based load elimination"));
 
 // Maximum allowed recursion depth.
 static cl::opt<uint32_t>
 MaxRecurseDepth("max-recurse-depth", cl::Hidden, cl::init(1000), cl::ZeroOrMore,
                 cl::desc("Max recurse depth (default = 1000)"));
 
+// Loads with more non-local dependencies than this are left alone entirely:
+// neither fully redundant load elimination nor load PRE is attempted.
+static cl::opt<uint32_t>
+MaxNumDeps("gvn-max-num-deps", cl::Hidden, cl::init(100), cl::ZeroOrMore,
+           cl::desc("Max number of non-local dependences of a load that GVN "
+                    "will try to eliminate it across (default = 100)"));
+
 struct llvm::GVN::Expression {
   uint32_t opcode;
   Type *type;
@@ -579,6 +600,11 @@ void GVN::ValueTable::verifyRemoved(const Value *V) const {
 //                                GVN Pass
 //===----------------------------------------------------------------------===//
 
+static bool eliminateLoadsWithMemorySSA(Function &F, MemorySSA &MSSA,
+                                        DominatorTree &DT,
+                                        MemoryDependenceResults *MD,
+                                        OptimizationRemarkEmitter *ORE);
+
 PreservedAnalyses GVN::run(Function &F, FunctionAnalysisManager &AM) {
   // FIXME: The order of evaluation of these 'getResult' calls is very
   // significant! Re-ordering these variables will cause GVN when run alone to
@@ -591,7 +617,12 @@ PreservedAnalyses GVN::run(Function &F, FunctionAnalysisManager &AM) {
   auto &MemDep = AM.getResult<MemoryDependenceAnalysis>(F);
   auto *LI = AM.getCachedResult<LoopAnalysis>(F);
   auto &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
-  bool Changed = runImpl(F, AC, DT, TLI, AA, &MemDep, LI, &ORE);
+  bool Changed = false;
+  if (EnableMSSALoadElim) {
+    auto &MSSA = AM.getResult<MemorySSAAnalysis>(F).getMSSA();
+    Changed |= eliminateLoadsWithMemorySSA(F, MSSA, DT, &MemDep, &ORE);
+  }
+  Changed |= runImpl(F, AC, DT, TLI, AA, &MemDep, LI, &ORE);
   if (!Changed)
     return PreservedAnalyses::all();
   PreservedAnalyses PA;
@@ -1230,13 +1261,16 @@ bool GVN::processNonLocalLoad(LoadInst *LI) {
   // Step 1: Find the non-local dependencies of the load.
   LoadDepVect Deps;
   MD->getNonLocalPointerDependency(LI, Deps);
+  ++NumNonLocalLoadQueries;
 
-  // If we had to process more than one hundred blocks to find the
+  // If we had to process more than MaxNumDeps blocks to find the
   // dependencies, this load isn't worth worrying about.  Optimizing
   // it will be too expensive.
   unsigned NumDeps = Deps.size();
-  if (NumDeps > 100)
+  if (NumDeps > MaxNumDeps) {
+    ++NumNonLocalLoadTooManyDeps;
     return false;
+  }
 
   // If we had a phi translation failure, we'll have a single entry which is a
   // clobber in the current block.  Reject this early.
@@ -1815,6 +1849,92 @@ bool GVN::processInstruction(Instruction *I) {
   return true;
 }
 
+/// Eliminate loads that are fully redundant with an earlier load or store of
+/// the same pointer, using MemorySSA to prove that memory is not clobbered in
+/// between.  The clobber queries go through the caching MemorySSA walker
+/// rather than MemoryDependenceAnalysis, so they are not cut off by its block
+/// and dependency scan limits, and this keeps finding redundancies on large
+/// CFGs where processNonLocalLoad gives up.  The walker itself is not bounded;
+/// only the number of earlier accesses compared per load is, by
+/// -gvn-memssa-scan-limit.  Partial redundancies are still left to load PRE.
+/// This runs before GVN::runImpl so that MSSA, which GVN does not keep up to
+/// date, still describes the function.
+static bool eliminateLoadsWithMemorySSA(Function &F, MemorySSA &MSSA,
+                                        DominatorTree &DT,
+                                        MemoryDependenceResults *MD,
+                                        OptimizationRemarkEmitter *ORE) {
+  MemorySSAUpdater Updater(&MSSA);
+  MemorySSAWalker *Walker = MSSA.getWalker();
+
+  // The simple loads and stores of each pointer seen so far.  Walking the
+  // blocks in RPO means that any access dominating a load has been seen.
+  DenseMap<Value *, SmallVector<Instruction *, 4>> Accesses;
+  bool Changed = false;
+
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    for (BasicBlock::iterator BI = BB->begin(), BE = BB->end(); BI != BE;) {
+      Instruction *I = &*BI++;
+      if (auto *SI = dyn_cast<StoreInst>(I)) {
+        if (SI->isSimple())
+          Accesses[SI->getPointerOperand()].push_back(SI);
+        continue;
+      }
+
+      auto *LI = dyn_cast<LoadInst>(I);
+      if (!LI || !LI->isSimple())
+        continue;
+      MemoryAccess *LoadMA = MSSA.getMemoryAccess(LI);
+      if (!LoadMA)
+        continue;
+
+      SmallVectorImpl<Instruction *> &Earlier =
+          Accesses[LI->getPointerOperand()];
+      Value *Repl = nullptr;
+      if (!Earlier.empty()) {
+        // An earlier access that dominates the load sees the same memory if
+        // the load's clobber dominates it, just like EarlyCSE's generations.
+        MemoryAccess *Clobber = Walker->getClobberingMemoryAccess(LI);
+        unsigned Scanned = 0;
+        for (auto It = Earlier.rbegin(), E = Earlier.rend();
+             It != E && Scanned != MSSALoadElimScanLimit; ++It, ++Scanned) {
+          Instruction *EI = *It;
+          Value *V = EI;
+          if (auto *SI = dyn_cast<StoreInst>(EI))
+            V = SI->getValueOperand();
+          MemoryAccess *EarlierMA = MSSA.getMemoryAccess(EI);
+          if (V->getType() != LI->getType() || !EarlierMA ||
+              !DT.dominates(EI, LI) || !MSSA.dominates(Clobber, EarlierMA))
+            continue;
+          Repl = V;
+          break;
+        }
+      }
+
+      if (!Repl) {
+        Earlier.push_back(LI);
+        continue;
+      }
+
+      DEBUG(dbgs() << "GVN MSSA REMOVING LOAD: " << *LI << '\n');
+      patchAndReplaceAllUsesWith(LI, Repl);
+      ++NumMSSALoad;
+      reportLoadElim(LI, Repl, ORE);
+      if (MD) {
+        if (Repl->getType()->getScalarType()->isPointerTy())
+          MD->invalidateCachedPointerInfo(Repl);
+        MD->removeInstruction(LI);
+      }
+      // A load is a MemoryUse, which nothing else in MemorySSA refers to.
+      Updater.removeMemoryAccess(LoadMA);
+      LI->eraseFromParent();
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+
 /// runOnFunction - This is the main transformation entry point for a function.
 bool GVN::runImpl(Function &F, AssumptionCache &RunAC, DominatorTree &RunDT,
                   const TargetLibraryInfo &RunTLI, AAResults &RunAA,
@@ -2326,16 +2446,23 @@ public:
       return false;
 
     auto *LIWP = getAnalysisIfAvailable<LoopInfoWrapperPass>();
+    auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    auto *MD = NoLoads
+                   ? nullptr
+                   : &getAnalysis<MemoryDependenceWrapperPass>().getMemDep();
+    auto *ORE = &getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+
+    bool Changed = false;
+    if (EnableMSSALoadElim && !NoLoads)
+      Changed |= eliminateLoadsWithMemorySSA(
+          F, getAnalysis<MemorySSAWrapperPass>().getMSSA(), DT, MD, ORE);
 
-    return Impl.runImpl(
-        F, getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F),
-        getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
+    Changed |= Impl.runImpl(
+        F, getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F), DT,
         getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(),
-        getAnalysis<AAResultsWrapperPass>().getAAResults(),
-        NoLoads ? nullptr
-                : &getAnalysis<MemoryDependenceWrapperPass>().getMemDep(),
-        LIWP ? &LIWP->getLoopInfo() : nullptr,
-        &getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE());
+        getAnalysis<AAResultsWrapperPass>().getAAResults(), MD,
+        LIWP ? &LIWP->getLoopInfo() : nullptr, ORE);
+    return Changed;
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
@@ -2344,6 +2471,8 @@ public:
     AU.addRequired<TargetLibraryInfoWrapperPass>();
     if (!NoLoads)
       AU.addRequired<MemoryDependenceWrapperPass>();
+    if (!NoLoads && EnableMSSALoadElim)
+      AU.addRequired<MemorySSAWrapperPass>();
     AU.addRequired<AAResultsWrapperPass>();
 
     AU.addPreserved<DominatorTreeWrapperPass>();
@@ -2367,6 +2496,7 @@ FunctionPass *llvm::createGVNPass(bool NoLoads) {
 INITIALIZE_PASS_BEGIN(GVNLegacyPass, "gvn", "Global Value Numbering", false, false)
 INITIALIZE_PASS_DEPENDENCY(AssumptionCacheTracker)
 INITIALIZE_PASS_DEPENDENCY(MemoryDependenceWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(MemorySSAWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfoWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(AAResultsWrapperPass)
@@ -25,6 +25,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/GlobalsModRef.h"
@@ -44,6 +45,7 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/PatternMatch.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
@@ -62,6 +64,8 @@ STATISTIC(NumReplaced    , "Number of exit values replaced");
 STATISTIC(NumLFTR        , "Number of loop exit tests replaced");
 STATISTIC(NumElimExt     , "Number of IV sign/zero extends eliminated");
 STATISTIC(NumElimIV      , "Number of congruent IVs eliminated");
+STATISTIC(NumReusedExpansions,
+          "Number of SCEV expansions reused within a loop nest");
 
 // Trip count verification can be enabled by default under NDEBUG if we
 // implement a strong expression equivalence checker in SCEV. Until then, we
@@ -86,6 +90,114 @@ static cl::opt<bool> UsePostIncrementRanges(
   cl::desc("Use post increment control-dependent ranges in IndVarSimplify"),
   cl::init(true));
 
+static cl::opt<bool> ReuseNestExpansions(
+  "indvars-reuse-nest-expansions", cl::Hidden, cl::init(true),
+  cl::desc("Reuse exit value and loop limit expansions made for other loops "
+           "of the same loop nest"));
+
+namespace {
+/// The loop-invariant values IndVarSimplify has materialized while simplifying
+/// the loops of one loop nest. The loops of a nest are visited innermost
+/// first, and the exit values and loop limits computed for an inner loop are
+/// often needed again when the parent's own exit values and limit are
+/// expanded, whether SCEVExpander left them in the parent's body or hoisted
+/// them further out.
+class LoopNestExpansions {
+  ScalarEvolution *SE = nullptr;
+  DominatorTree *DT = nullptr;
+  LoopInfo *LI = nullptr;
+  /// The function and the outermost loop of the nest the expansions belong
+  /// to. Loops of different functions may be allocated at the same address.
+  const Function *F = nullptr;
+  const Loop *Nest = nullptr;
+  DenseMap<const SCEV *, SmallVector<WeakTrackingVH, 2>> Expansions;
+
+public:
+  /// Prepare for simplifying \p L, forgetting the expansions of any other
+  /// loop nest.
+  void enterLoop(const Loop *L, ScalarEvolution *SE, DominatorTree *DT,
+                 LoopInfo *LI);
+
+  /// Return a value computing \p S, which is invariant in \p L, that is
+  /// available at \p InsertPt without breaking LCSSA, or null if there is
+  /// none.
+  Value *find(const SCEV *S, Type *Ty, Instruction *InsertPt,
+              const Loop *L) const;
+
+  void record(const SCEV *S, Value *V);
+
+  void clear() {
+    F = nullptr;
+    Nest = nullptr;
+    Expansions.clear();
+  }
+};
+} // end anonymous namespace
+
+void LoopNestExpansions::enterLoop(const Loop *L, ScalarEvolution *SE,
+                                   DominatorTree *DT, LoopInfo *LI) {
+  const Loop *Outermost = L;
+  while (Outermost->getParentLoop())
+    Outermost = Outermost->getParentLoop();
+  const Function *LoopF = L->getHeader()->getParent();
+  if (LoopF != F || Outermost != Nest || SE != this->SE) {
+    clear();
+    F = LoopF;
+    Nest = Outermost;
+  }
+  this->SE = SE;
+  this->DT = DT;
+  this->LI = LI;
+}
+
+Value *LoopNestExpansions::find(const SCEV *S, Type *Ty,
+                                Instruction *InsertPt, const Loop *L) const {
+  auto It = Expansions.find(S);
+  if (It == Expansions.end())
+    return nullptr;
+  for (Value *V : It->second) {
+    // The value may have been deleted, or rewritten into something else, by
+    // the passes that ran on the loops visited in between.
+    if (!V || V->getType() != Ty || !SE->isSCEVable(Ty) || SE->getSCEV(V) != S)
+      continue;
+    auto *I = dyn_cast<Instruction>(V);
+    if (!I)
+      return V;
+    // A value in L's own body is fine: S is invariant in L, so it computes
+    // the same value on every iteration. Don't reach into a loop that doesn't
+    // contain InsertPt, though; that would break LCSSA.
+    if (!DT->dominates(I, InsertPt))
+      continue;
+    if (const Loop *DefLoop = LI->getLoopFor(I->getParent()))
+      if (!DefLoop->contains(InsertPt))
+        continue;
+    return V;
+  }
+  return nullptr;
+}
+
+void LoopNestExpansions::record(const SCEV *S, Value *V) {
+  if (!ReuseNestExpansions || isa<Constant>(V))
+    return;
+  SmallVectorImpl<WeakTrackingVH> &Values = Expansions[S];
+  if (!is_contained(Values, V))
+    Values.push_back(V);
+}
+
+/// Expand \p S, which is invariant in \p L, at \p InsertPt, unless another
+/// loop of the nest has already done so.
+static Value *expandForNest(SCEVExpander &Rewriter,
+                            LoopNestExpansions &NestExpansions, const SCEV *S,
+                            Type *Ty, Instruction *InsertPt, const Loop *L) {
+  if (Value *V = NestExpansions.find(S, Ty, InsertPt, L)) {
+    ++NumReusedExpansions;
+    return V;
+  }
+  Value *V = Rewriter.expandCodeFor(S, Ty, InsertPt);
+  NestExpansions.record(S, V);
+  return V;
+}
+
 namespace {
 struct RewritePhi;
 
@@ -96,6 +208,7 @@ class IndVarSimplify {
   const DataLayout &DL;
   TargetLibraryInfo *TLI;
   const TargetTransformInfo *TTI;
+  LoopNestExpansions &NestExpansions;
 
   SmallVector<WeakTrackingVH, 16> DeadInsts;
   bool Changed = false;
@@ -122,8 +235,9 @@ class IndVarSimplify {
 public:
   IndVarSimplify(LoopInfo *LI, ScalarEvolution *SE, DominatorTree *DT,
                  const DataLayout &DL, TargetLibraryInfo *TLI,
-                 TargetTransformInfo *TTI)
-      : LI(LI), SE(SE), DT(DT), DL(DL), TLI(TLI), TTI(TTI) {}
+                 TargetTransformInfo *TTI, LoopNestExpansions &NestExpansions)
+      : LI(LI), SE(SE), DT(DT), DL(DL), TLI(TLI), TTI(TTI),
+        NestExpansions(NestExpansions) {}
 
   bool run(Loop *L);
 };
@@ -491,7 +605,7 @@ Value *IndVarSimplify::expandSCEVIfNeeded(SCEVExpander &Rewriter, const SCEV *S,
       return ExistingValue;
 
   // We didn't find anything, fall back to using SCEVExpander.
-  return Rewriter.expandCodeFor(S, ResultTy, InsertPt);
+  return expandForNest(Rewriter, NestExpansions, S, ResultTy, InsertPt, L);
 }
 
 //===----------------------------------------------------------------------===//
@@ -2052,7 +2166,8 @@ static PHINode *FindLoopCounter(Loop *L, const SCEV *BECount,
 /// Help linearFunctionTestReplace by generating a value that holds the RHS of
 /// the new loop test.
 static Value *genLoopLimit(PHINode *IndVar, const SCEV *IVCount, Loop *L,
-                           SCEVExpander &Rewriter, ScalarEvolution *SE) {
+                           SCEVExpander &Rewriter, ScalarEvolution *SE,
+                           LoopNestExpansions &NestExpansions) {
   const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(IndVar));
   assert(AR && AR->getLoop() == L && AR->isAffine() && "bad loop counter");
   const SCEV *IVInit = AR->getStart();
@@ -2075,7 +2190,8 @@ static Value *genLoopLimit(PHINode *IndVar, const SCEV *IVCount, Loop *L,
     assert(SE->isLoopInvariant(IVOffset, L) &&
            "Computed iteration count is not loop invariant!");
     BranchInst *BI = cast<BranchInst>(L->getExitingBlock()->getTerminator());
-    Value *GEPOffset = Rewriter.expandCodeFor(IVOffset, OfsTy, BI);
+    Value *GEPOffset =
+        expandForNest(Rewriter, NestExpansions, IVOffset, OfsTy, BI, L);
 
     Value *GEPBase = IndVar->getIncomingValueForBlock(L->getLoopPreheader());
     assert(AR->getStart() == SE->getSCEV(GEPBase) && "bad loop counter");
@@ -2126,7 +2242,7 @@ static Value *genLoopLimit(PHINode *IndVar, const SCEV *IVCount, Loop *L,
     // SCEV expression (IVInit) for a pointer type IV value (IndVar).
     Type *LimitTy = IVCount->getType()->isPointerTy() ?
       IndVar->getType() : IVCount->getType();
-    return Rewriter.expandCodeFor(IVLimit, LimitTy, BI);
+    return expandForNest(Rewriter, NestExpansions, IVLimit, LimitTy, BI, L);
   }
 }
 
@@ -2163,7 +2279,8 @@ linearFunctionTestReplace(Loop *L,
     CmpIndVar = IndVar->getIncomingValueForBlock(L->getExitingBlock());
   }
 
-  Value *ExitCnt = genLoopLimit(IndVar, IVCount, L, Rewriter, SE);
+  Value *ExitCnt =
+      genLoopLimit(IndVar, IVCount, L, Rewriter, SE, NestExpansions);
   assert(ExitCnt->getType()->isPointerTy() ==
              IndVar->getType()->isPointerTy() &&
          "genLoopLimit missed a cast");
@@ -2376,6 +2493,8 @@ bool IndVarSimplify::run(Loop *L) {
   if (!L->isLoopSimplifyForm())
     return false;
 
+  NestExpansions.enterLoop(L, SE, DT, LI);
+
   // If there are any floating-point recurrences, attempt to
   // transform them to use integer recurrences.
   rewriteNonIntegerIVs(L);
@@ -2485,7 +2604,11 @@ PreservedAnalyses IndVarSimplifyPass::run(Loop &L, LoopAnalysisManager &AM,
   Function *F = L.getHeader()->getParent();
   const DataLayout &DL = F->getParent()->getDataLayout();
 
-  IndVarSimplify IVS(&AR.LI, &AR.SE, &AR.DT, DL, &AR.TLI, &AR.TTI);
+  // Loop passes are not preserved between loops here, so the expansions are
+  // only shared between the exit values and the limit of this loop.
+  LoopNestExpansions NestExpansions;
+  IndVarSimplify IVS(&AR.LI, &AR.SE, &AR.DT, DL, &AR.TLI, &AR.TTI,
+                     NestExpansions);
   if (!IVS.run(&L))
     return PreservedAnalyses::all();
 
@@ -2496,6 +2619,10 @@ PreservedAnalyses IndVarSimplifyPass::run(Loop &L, LoopAnalysisManager &AM,
 
 namespace {
 struct IndVarSimplifyLegacyPass : public LoopPass {
+  /// Kept across the loops of a nest, which the loop pass manager visits one
+  /// after the other, innermost first.
+  LoopNestExpansions NestExpansions;
+
   static char ID; // Pass identification, replacement for typeid
   IndVarSimplifyLegacyPass() : LoopPass(ID) {
     initializeIndVarSimplifyLegacyPassPass(*PassRegistry::getPassRegistry());
@@ -2514,10 +2641,15 @@ struct IndVarSimplifyLegacyPass : public LoopPass {
     auto *TTI = TTIP ? &TTIP->getTTI(*L->getHeader()->getParent()) : nullptr;
     const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
 
-    IndVarSimplify IVS(LI, SE, DT, DL, TLI, TTI);
+    IndVarSimplify IVS(LI, SE, DT, DL, TLI, TTI, NestExpansions);
     return IVS.run(L);
   }
 
+  bool doFinalization() override {
+    NestExpansions.clear();
+    return false;
+  }
+
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.setPreservesCFG();
     getLoopAnalysisUsage(AU);
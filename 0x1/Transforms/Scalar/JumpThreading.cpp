@@ -15,6 +15,7 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/DepthFirstIterator.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/AliasAnalysis.h"
@@ -50,6 +51,12 @@ using namespace jumpthreading;
 STATISTIC(NumThreads, "Number of jumps threaded");
 STATISTIC(NumFolds,   "Number of terminators folded");
 STATISTIC(NumDupes,   "Number of branch blocks duplicated to eliminate phi");
+STATISTIC(NumFSMThreads, "Number of state machine paths threaded");
+STATISTIC(NumLVIQueries, "Number of LazyValueInfo queries issued");
+STATISTIC(NumBlocksRevisited,
+          "Number of blocks reprocessed after the first sweep");
+STATISTIC(NumBlocksSkipped,
+          "Number of blocks skipped because nothing upstream changed");
 
 static cl::opt<unsigned>
 BBDuplicateThreshold("jump-threading-threshold",
@@ -63,6 +70,35 @@ ImplicationSearchThreshold(
            "condition to use to thread over a weaker condition"),
   cl::init(3), cl::Hidden);
 
+static cl::opt<bool> IncrementalRevisit(
+    "jump-threading-incremental", cl::init(true), cl::Hidden,
+    cl::desc("After the first sweep, only revisit blocks reachable from "
+             "blocks that changed in the previous sweep"));
+
+static cl::opt<bool> ThreadFSM(
+    "jump-threading-fsm", cl::init(false), cl::Hidden,
+    cl::desc("Thread paths through switch-based state machines on which the "
+             "next state is a known constant, even across loop headers"));
+
+static cl::opt<unsigned> FSMMaxPathLength(
+    "jump-threading-fsm-max-path", cl::init(4), cl::Hidden,
+    cl::desc("Max number of blocks to duplicate along one state machine "
+             "path"));
+
+static cl::opt<unsigned> FSMMaxPathsPerSwitch(
+    "jump-threading-fsm-max-paths", cl::init(64), cl::Hidden,
+    cl::desc("Max number of candidate paths to consider per switch"));
+
+static cl::opt<unsigned> FSMPathThreshold(
+    "jump-threading-fsm-path-threshold", cl::init(24), cl::Hidden,
+    cl::desc("Max number of instructions to duplicate for one state "
+             "machine path"));
+
+static cl::opt<unsigned> FSMBudget(
+    "jump-threading-fsm-budget", cl::init(256), cl::Hidden,
+    cl::desc("Max number of instructions to duplicate per function when "
+             "threading state machines"));
+
 namespace {
   /// This pass performs 'jump threading', which looks at blocks that have
   /// multiple predecessors and multiple successors.  If one or more of the
@@ -166,6 +202,9 @@ PreservedAnalyses JumpThreadingPass::run(Function &F,
   return PA;
 }
 
+static bool threadFSMSwitches(Function &F, LazyValueInfo *LVI,
+                              const TargetLibraryInfo *TLI);
+
 bool JumpThreadingPass::runImpl(Function &F, TargetLibraryInfo *TLI_,
                                 LazyValueInfo *LVI_, AliasAnalysis *AA_,
                                 bool HasProfileData_,
@@ -199,16 +238,74 @@ bool JumpThreadingPass::runImpl(Function &F, TargetLibraryInfo *TLI_,
   bool EverChanged = false;
   EverChanged |= removeUnreachableBlocks(F, LVI);
 
+  // Thread state machines first; this deliberately crosses loop headers, so
+  // it has to happen before we record them. It doesn't keep block frequencies
+  // up to date, so leave functions with profile data alone.
+  if (ThreadFSM && !HasProfileData)
+    EverChanged |= threadFSMSwitches(F, LVI, TLI);
+
   FindLoopHeaders(F);
 
+  // Everything LVI knows flows forward along the CFG, so once a sweep has
+  // gone over every block, a block that is not reachable from anything
+  // changed in the previous sweep would just get the same answers from LVI
+  // again. Remember the neighbourhood of each change and only revisit the
+  // region downstream of it. Blocks threading creates sit next to the
+  // successors of the threaded block, so those successors' predecessors are
+  // remembered too.
+  SmallPtrSet<BasicBlock *, 16> TouchedBlocks;
+  auto TouchNeighbourhood = [&](BasicBlock *BB) {
+    TouchedBlocks.insert(BB);
+    for (BasicBlock *Pred : predecessors(BB))
+      TouchedBlocks.insert(Pred);
+    for (BasicBlock *Succ : successors(BB)) {
+      TouchedBlocks.insert(Succ);
+      for (BasicBlock *SuccPred : predecessors(Succ))
+        TouchedBlocks.insert(SuccPred);
+    }
+  };
+
   bool Changed;
+  bool FirstSweep = true;
   do {
     Changed = false;
+
+    // Blocks may have been deleted since they were touched, so only start
+    // from ones that are still in the function.
+    SmallPtrSet<BasicBlock *, 32> Region;
+    if (!FirstSweep && IncrementalRevisit) {
+      SmallPtrSet<BasicBlock *, 32> LiveBlocks;
+      for (BasicBlock &BB : F)
+        LiveBlocks.insert(&BB);
+      for (BasicBlock *Touched : TouchedBlocks)
+        if (LiveBlocks.count(Touched))
+          for (BasicBlock *Reached : depth_first_ext(Touched, Region))
+            (void)Reached;
+    }
+    TouchedBlocks.clear();
+
     for (Function::iterator I = F.begin(), E = F.end(); I != E;) {
       BasicBlock *BB = &*I;
-      // Thread all of the branches we can over this block.
-      while (ProcessBlock(BB))
+      if (!FirstSweep && IncrementalRevisit) {
+        if (!Region.count(BB)) {
+          ++NumBlocksSkipped;
+          ++I;
+          continue;
+        }
+        ++NumBlocksRevisited;
+      }
+
+      // Thread all of the branches we can over this block.  Folding or
+      // threading the terminator can drop edges to successors that then die,
+      // so touch the successors BB had going in as well; otherwise they are
+      // never revisited and zapped.
+      SmallVector<BasicBlock *, 4> OldSuccs(succ_begin(BB), succ_end(BB));
+      while (ProcessBlock(BB)) {
         Changed = true;
+        TouchNeighbourhood(BB);
+        TouchedBlocks.insert(OldSuccs.begin(), OldSuccs.end());
+        OldSuccs.assign(succ_begin(BB), succ_end(BB));
+      }
 
       ++I;
 
@@ -220,6 +317,8 @@ bool JumpThreadingPass::runImpl(Function &F, TargetLibraryInfo *TLI_,
               << "' with terminator: " << *BB->getTerminator() << '\n');
         LoopHeaders.erase(BB);
         LVI->eraseBlock(BB);
+        for (BasicBlock *Succ : successors(BB))
+          TouchedBlocks.insert(Succ);
         DeleteDeadBlock(BB);
         Changed = true;
         continue;
@@ -242,11 +341,16 @@ bool JumpThreadingPass::runImpl(Function &F, TargetLibraryInfo *TLI_,
         // awesome, but it allows us to use AssertingVH to prevent nasty
         // dangling pointer issues within LazyValueInfo.
         LVI->eraseBlock(BB);
-        if (TryToSimplifyUncondBranchFromEmptyBlock(BB))
+        SmallVector<BasicBlock *, 8> Neighbours(pred_begin(BB), pred_end(BB));
+        Neighbours.push_back(BI->getSuccessor(0));
+        if (TryToSimplifyUncondBranchFromEmptyBlock(BB)) {
           Changed = true;
+          TouchedBlocks.insert(Neighbours.begin(), Neighbours.end());
+        }
       }
     }
     EverChanged |= Changed;
+    FirstSweep = false;
   } while (Changed);
 
   LoopHeaders.clear();
@@ -447,6 +551,7 @@ bool JumpThreadingPass::ComputeValueKnownInPredecessors(
     for (BasicBlock *P : predecessors(BB)) {
       // If the value is known by LazyValueInfo to be a constant in a
       // predecessor, use that information to try to thread this block.
+      ++NumLVIQueries;
       Constant *PredCst = LVI->getConstantOnEdge(V, P, BB, CxtI);
       if (Constant *KC = getKnownConstant(PredCst, Preference))
         Result.push_back(std::make_pair(KC, P));
@@ -462,6 +567,7 @@ bool JumpThreadingPass::ComputeValueKnownInPredecessors(
       if (Constant *KC = getKnownConstant(InVal, Preference)) {
         Result.push_back(std::make_pair(KC, PN->getIncomingBlock(i)));
       } else {
+        ++NumLVIQueries;
         Constant *CI = LVI->getConstantOnEdge(InVal,
                                               PN->getIncomingBlock(i),
                                               BB, CxtI);
@@ -591,6 +697,7 @@ bool JumpThreadingPass::ComputeValueKnownInPredecessors(
           if (!isa<Constant>(RHS))
             continue;
 
+          ++NumLVIQueries;
           LazyValueInfo::Tristate
             ResT = LVI->getPredicateOnEdge(Cmp->getPredicate(), LHS,
                                            cast<Constant>(RHS), PredBB, BB,
@@ -617,6 +724,7 @@ bool JumpThreadingPass::ComputeValueKnownInPredecessors(
         for (BasicBlock *P : predecessors(BB)) {
           // If the value is known by LazyValueInfo to be a constant in a
           // predecessor, use that information to try to thread this block.
+          ++NumLVIQueries;
           LazyValueInfo::Tristate Res =
             LVI->getPredicateOnEdge(Cmp->getPredicate(), Cmp->getOperand(0),
                                     CmpConst, P, BB, CxtI ? CxtI : Cmp);
@@ -683,6 +791,7 @@ bool JumpThreadingPass::ComputeValueKnownInPredecessors(
   }
 
   // If all else fails, see if LVI can figure out a constant value for us.
+  ++NumLVIQueries;
   Constant *CI = LVI->getConstant(V, BB, CxtI);
   if (Constant *KC = getKnownConstant(CI, Preference)) {
     for (BasicBlock *Pred : predecessors(BB))
@@ -851,6 +960,7 @@ bool JumpThreadingPass::ProcessBlock(BasicBlock *BB) {
       // threading is concerned.
       assert(CondBr->isConditional() && "Threading on unconditional terminator");
 
+      ++NumLVIQueries;
       LazyValueInfo::Tristate Ret =
         LVI->getPredicateAt(CondCmp->getPredicate(), CondCmp->getOperand(0),
                             CondConst, CondBr);
@@ -1572,6 +1682,306 @@ static void AddPHINodeEntriesForMappedBlock(BasicBlock *PHIBB,
   }
 }
 
+namespace {
+/// A path along which the condition of a switch folds to a constant: control
+/// comes from Pred into Blocks.front(), and Blocks.back() ends in the switch.
+struct FSMThreadingPath {
+  BasicBlock *Pred;
+  SmallVector<BasicBlock *, 4> Blocks;
+};
+} // end anonymous namespace
+
+/// Walk backwards from RevPath.back() looking for predecessors in which V,
+/// the value live into that block, is a constant. V may be a PHI in the block,
+/// which is resolved per predecessor, or a PHI further up which is carried
+/// through unchanged. RevPath holds the blocks seen so far in reverse order,
+/// starting with the switch block.
+static void findFSMPaths(Value *V, SmallVectorImpl<BasicBlock *> &RevPath,
+                         SmallVectorImpl<FSMThreadingPath> &Paths) {
+  auto *PN = dyn_cast<PHINode>(V);
+  if (!PN || (PN->getParent() != RevPath.back() &&
+              is_contained(RevPath, PN->getParent())))
+    return;
+
+  BasicBlock *BB = RevPath.back();
+  bool ResolveHere = PN->getParent() == BB;
+  SmallPtrSet<BasicBlock *, 8> Visited;
+  for (BasicBlock *Pred : predecessors(BB)) {
+    if (Paths.size() >= FSMMaxPathsPerSwitch)
+      return;
+    if (!Visited.insert(Pred).second)
+      continue;
+
+    Value *In = ResolveHere ? PN->getIncomingValueForBlock(Pred) : V;
+    if (isa<ConstantInt>(In)) {
+      FSMThreadingPath P;
+      P.Pred = Pred;
+      P.Blocks.assign(RevPath.rbegin(), RevPath.rend());
+      Paths.push_back(std::move(P));
+      continue;
+    }
+    if (RevPath.size() >= FSMMaxPathLength || is_contained(RevPath, Pred))
+      continue;
+    RevPath.push_back(Pred);
+    findFSMPaths(In, RevPath, Paths);
+    RevPath.pop_back();
+  }
+}
+
+/// Return the constant Cond takes when control follows P, or null if P is
+/// no longer a path in the CFG or Cond isn't constant along it.
+static ConstantInt *getFSMPathState(const FSMThreadingPath &P, Value *Cond) {
+  Value *V = Cond;
+  for (unsigned j = P.Blocks.size(); j-- > 0;) {
+    BasicBlock *BB = P.Blocks[j];
+    BasicBlock *From = j ? P.Blocks[j - 1] : P.Pred;
+    if (!is_contained(successors(From), BB))
+      return nullptr;
+    if (auto *PN = dyn_cast<PHINode>(V))
+      if (PN->getParent() == BB) {
+        V = PN->getIncomingValueForBlock(From);
+        continue;
+      }
+    if (auto *I = dyn_cast<Instruction>(V))
+      if (I->getParent() == BB)
+        return nullptr;
+  }
+  return dyn_cast<ConstantInt>(V);
+}
+
+/// Check that the blocks of P can be cloned into a straight-line copy entered
+/// only from P.Pred, and compute the cost of doing so.
+///
+/// Every value the copy of a block refers to must either be defined outside
+/// the path or earlier along it, so that the copy can use the copied
+/// definition. A reference to something defined in the same or a later block
+/// can only come around a loop, and would need new PHIs in the copies; such
+/// paths are rejected.
+static bool isFSMPathClonable(const FSMThreadingPath &P, unsigned &Cost) {
+  DenseMap<BasicBlock *, unsigned> Index;
+  for (unsigned j = 0, e = P.Blocks.size(); j != e; ++j)
+    if (!Index.insert({P.Blocks[j], j}).second)
+      return false;
+  if (Index.count(P.Pred))
+    return false;
+
+  TerminatorInst *PredTerm = P.Pred->getTerminator();
+  if ((!isa<BranchInst>(PredTerm) && !isa<SwitchInst>(PredTerm)) ||
+      std::count(succ_begin(P.Pred), succ_end(P.Pred), P.Blocks[0]) != 1)
+    return false;
+
+  // Returns true if V is defined in the path at or after block J.
+  auto DefinedAtOrAfter = [&](Value *V, unsigned J) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (!I)
+      return false;
+    auto It = Index.find(I->getParent());
+    return It != Index.end() && It->second >= J;
+  };
+
+  Cost = 0;
+  for (unsigned j = 0, e = P.Blocks.size(); j != e; ++j) {
+    BasicBlock *BB = P.Blocks[j];
+    TerminatorInst *Term = BB->getTerminator();
+    if (BB->hasAddressTaken() || BB->isEHPad() ||
+        (!isa<BranchInst>(Term) && !isa<SwitchInst>(Term)))
+      return false;
+
+    unsigned BlockCost =
+        getJumpThreadDuplicationCost(BB, Term, FSMPathThreshold);
+    if (BlockCost == ~0U)
+      return false;
+    // Charge at least one per block so that the budget always runs out.
+    Cost += std::max(BlockCost, 1U);
+    if (Cost > FSMPathThreshold)
+      return false;
+
+    BasicBlock *From = j ? P.Blocks[j - 1] : P.Pred;
+    for (Instruction &I : *BB) {
+      if (auto *PN = dyn_cast<PHINode>(&I)) {
+        if (DefinedAtOrAfter(PN->getIncomingValueForBlock(From), j))
+          return false;
+        continue;
+      }
+      for (Value *Op : I.operands())
+        if (DefinedAtOrAfter(Op, j + 1))
+          return false;
+    }
+
+    for (BasicBlock *Succ : successors(BB)) {
+      if (j + 1 != e && Succ == P.Blocks[j + 1])
+        continue;
+      for (BasicBlock::iterator PNI = Succ->begin();
+           PHINode *PN = dyn_cast<PHINode>(PNI); ++PNI)
+        if (DefinedAtOrAfter(PN->getIncomingValueForBlock(BB), j + 1))
+          return false;
+    }
+  }
+  return true;
+}
+
+/// Clone the blocks of P so that P.Pred enters a private copy of the path
+/// whose last block branches straight to Target instead of switching.
+static void threadFSMPath(const FSMThreadingPath &P, BasicBlock *Target,
+                          LazyValueInfo *LVI, const TargetLibraryInfo *TLI) {
+  DEBUG(dbgs() << "  JT: Threading FSM path from '" << P.Pred->getName()
+               << "' through " << P.Blocks.size() << " blocks to '"
+               << Target->getName() << "'\n");
+
+  unsigned NumBlocks = P.Blocks.size();
+  for (BasicBlock *BB : P.Blocks)
+    LVI->eraseBlock(BB);
+
+  SmallVector<BasicBlock *, 4> NewBlocks;
+  for (BasicBlock *BB : P.Blocks) {
+    BasicBlock *NewBB = BasicBlock::Create(BB->getContext(),
+                                           BB->getName() + ".fsm",
+                                           BB->getParent(), BB);
+    NewBlocks.push_back(NewBB);
+  }
+
+  DenseMap<Instruction *, Value *> ValueMapping;
+  auto MapValue = [&](Value *V) {
+    if (auto *I = dyn_cast<Instruction>(V)) {
+      auto It = ValueMapping.find(I);
+      if (It != ValueMapping.end())
+        return It->second;
+    }
+    return V;
+  };
+
+  for (unsigned j = 0; j != NumBlocks; ++j) {
+    BasicBlock *BB = P.Blocks[j];
+    BasicBlock *NewBB = NewBlocks[j];
+    BasicBlock *From = j ? P.Blocks[j - 1] : P.Pred;
+
+    // The copy has a single predecessor, so its PHIs fold away.
+    BasicBlock::iterator BI = BB->begin();
+    for (; PHINode *PN = dyn_cast<PHINode>(BI); ++BI)
+      ValueMapping[PN] = MapValue(PN->getIncomingValueForBlock(From));
+
+    for (; !isa<TerminatorInst>(BI); ++BI) {
+      Instruction *New = BI->clone();
+      New->setName(BI->getName());
+      NewBB->getInstList().push_back(New);
+      ValueMapping[&*BI] = New;
+      for (unsigned i = 0, e = New->getNumOperands(); i != e; ++i)
+        New->setOperand(i, MapValue(New->getOperand(i)));
+    }
+
+    // The last block branches straight to the case we know is taken; the
+    // others keep their terminator, with the edge along the path redirected
+    // to the next copy.
+    TerminatorInst *Term = BB->getTerminator();
+    if (j + 1 == NumBlocks) {
+      BranchInst::Create(Target, NewBB)->setDebugLoc(Term->getDebugLoc());
+      AddPHINodeEntriesForMappedBlock(Target, BB, NewBB, ValueMapping);
+      continue;
+    }
+    TerminatorInst *NewTerm = cast<TerminatorInst>(Term->clone());
+    NewBB->getInstList().push_back(NewTerm);
+    for (unsigned i = 0, e = NewTerm->getNumOperands(); i != e; ++i)
+      NewTerm->setOperand(i, MapValue(NewTerm->getOperand(i)));
+    for (unsigned i = 0, e = NewTerm->getNumSuccessors(); i != e; ++i) {
+      BasicBlock *Succ = NewTerm->getSuccessor(i);
+      if (Succ == P.Blocks[j + 1])
+        NewTerm->setSuccessor(i, NewBlocks[j + 1]);
+      else
+        AddPHINodeEntriesForMappedBlock(Succ, BB, NewBB, ValueMapping);
+    }
+  }
+
+  // Enter the copy from P.Pred instead of the original path.
+  P.Blocks[0]->removePredecessor(P.Pred, true);
+  TerminatorInst *PredTerm = P.Pred->getTerminator();
+  for (unsigned i = 0, e = PredTerm->getNumSuccessors(); i != e; ++i)
+    if (PredTerm->getSuccessor(i) == P.Blocks[0])
+      PredTerm->setSuccessor(i, NewBlocks[0]);
+
+  // Values defined along the path and used elsewhere now have two
+  // definitions; repair SSA form the same way ThreadEdge does. The path may
+  // run through a loop header, so rewriting the uses of one block's values
+  // can put new PHIs into a later block of the path. Those have no copy, so
+  // take the list of values to repair before rewriting anything.
+  SmallVector<std::pair<unsigned, Instruction *>, 32> Defs;
+  for (unsigned j = 0; j != NumBlocks; ++j)
+    for (Instruction &I : *P.Blocks[j])
+      if (ValueMapping.count(&I))
+        Defs.push_back({j, &I});
+
+  SSAUpdater SSAUpdate;
+  SmallVector<Use *, 16> UsesToRename;
+  for (const auto &Def : Defs) {
+    unsigned j = Def.first;
+    BasicBlock *BB = P.Blocks[j];
+    Instruction &I = *Def.second;
+    for (Use &U : I.uses()) {
+      Instruction *User = cast<Instruction>(U.getUser());
+      if (PHINode *UserPN = dyn_cast<PHINode>(User)) {
+        if (UserPN->getIncomingBlock(U) == BB)
+          continue;
+      } else if (User->getParent() == BB)
+        continue;
+
+      UsesToRename.push_back(&U);
+    }
+    if (UsesToRename.empty())
+      continue;
+
+    SSAUpdate.Initialize(I.getType(), I.getName());
+    SSAUpdate.AddAvailableValue(BB, &I);
+    SSAUpdate.AddAvailableValue(NewBlocks[j], ValueMapping[&I]);
+    while (!UsesToRename.empty())
+      SSAUpdate.RewriteUse(*UsesToRename.pop_back_val());
+  }
+
+  for (BasicBlock *NewBB : NewBlocks)
+    SimplifyInstructionsInBlock(NewBB, TLI);
+}
+
+/// Thread switch-based state machines. For each switch on a PHI, look for
+/// paths of up to FSMMaxPathLength blocks, possibly through loop headers,
+/// along which the switched-on value is a known constant, and give each one
+/// its own copy of the blocks that jumps directly to the right case. This
+/// stops when no more paths fit in the function's code growth budget.
+static bool threadFSMSwitches(Function &F, LazyValueInfo *LVI,
+                              const TargetLibraryInfo *TLI) {
+  SmallVector<SwitchInst *, 8> Switches;
+  for (BasicBlock &BB : F)
+    if (auto *SI = dyn_cast<SwitchInst>(BB.getTerminator()))
+      if (isa<PHINode>(SI->getCondition()))
+        Switches.push_back(SI);
+
+  unsigned Budget = FSMBudget;
+  bool Changed = false;
+  for (SwitchInst *SI : Switches) {
+    bool Threaded;
+    do {
+      Threaded = false;
+      SmallVector<FSMThreadingPath, 8> Paths;
+      SmallVector<BasicBlock *, 4> RevPath(1, SI->getParent());
+      findFSMPaths(SI->getCondition(), RevPath, Paths);
+
+      for (const FSMThreadingPath &P : Paths) {
+        ConstantInt *State = getFSMPathState(P, SI->getCondition());
+        unsigned Cost;
+        if (!State || !isFSMPathClonable(P, Cost) || Cost > Budget)
+          continue;
+        BasicBlock *Target = SI->findCaseValue(State)->getCaseSuccessor();
+        if (Target == SI->getParent())
+          continue;
+        threadFSMPath(P, Target, LVI, TLI);
+        Budget -= Cost;
+        ++NumFSMThreads;
+        Changed = Threaded = true;
+        // The CFG has changed under the remaining paths; look again.
+        break;
+      }
+    } while (Threaded);
+  }
+  return Changed;
+}
+
 /// ThreadEdge - We have decided that it is safe and profitable to factor the
 /// blocks in PredBBs to one predecessor, then thread an edge from it to SuccBB
 /// across BB.  Transform the IR to reflect this change.
@@ -2051,6 +2461,7 @@ bool JumpThreadingPass::TryToUnfoldSelect(CmpInst *CondCmp, BasicBlock *BB) {
     // Now check if one of the select values would allow us to constant fold the
     // terminator in BB. We don't do the transform if both sides fold, those
     // cases will be threaded in any case.
+    NumLVIQueries += 2;
     LazyValueInfo::Tristate LHSFolds =
         LVI->getPredicateOnEdge(CondCmp->getPredicate(), SI->getOperand(1),
                                 CondRHS, Pred, BB, CondCmp);
@@ -42,6 +42,8 @@
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
 #include "llvm/Analysis/OptimizationDiagnosticInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionAliasAnalysis.h"
@@ -52,6 +54,7 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LLVMContext.h"
@@ -76,27 +79,77 @@ STATISTIC(NumHoisted, "Number of instructions hoisted out of loop");
 STATISTIC(NumMovedLoads, "Number of load insts hoisted or sunk");
 STATISTIC(NumMovedCalls, "Number of call insts hoisted or sunk");
 STATISTIC(NumPromoted, "Number of memory locations promoted to registers");
+STATISTIC(NumPromotedConditional,
+          "Number of promoted locations written back under a dirty flag");
+STATISTIC(NumMSSAQueries, "Number of invariance queries answered by MemorySSA");
 
 /// Memory promotion is enabled by default.
 static cl::opt<bool>
     DisablePromotion("disable-licm-promotion", cl::Hidden, cl::init(false),
                      cl::desc("Disable memory promotion in LICM pass"));
 
+static cl::opt<bool> PromoteConditionalStores(
+    "licm-promote-conditional-stores", cl::Hidden, cl::init(false),
+    cl::desc("Promote locations whose stores are not guaranteed to execute, "
+             "writing them back at the exits only if the loop stored to "
+             "them"));
+
 static cl::opt<uint32_t> MaxNumUsesTraversed(
     "licm-max-num-uses-traversed", cl::Hidden, cl::init(8),
     cl::desc("Max num uses visited for identifying load "
              "invariance in loop using invariant start (default = 8)"));
 
+// Building an AliasSetTracker per loop, and merging inner loop trackers into
+// outer ones, gets expensive on deep loop nests.  With this flag LICM instead
+// answers its load and call invariance questions from the function's
+// MemorySSA, which is built once and kept up to date as instructions move.
+// Scalar promotion still needs alias sets, so it is skipped in this mode.
+//
+// LICM does not compute MemorySSA itself: loop passes that share its loop pass
+// manager, such as loop-rotate and loop-unswitch, don't preserve it, so a
+// MemorySSA required from inside the loop pipeline could be out of date. The
+// mode only takes effect on loops for which a MemorySSA computed before the
+// loop pipeline is still available, e.g. "-memoryssa -licm"; elsewhere LICM
+// falls back to alias sets.
+static cl::opt<bool> EnableLICMMemorySSA(
+    "licm-use-memssa", cl::Hidden, cl::init(false),
+    cl::desc("Use an available, preserved MemorySSA instead of alias set "
+             "trackers in LICM (legacy pass manager only; disables "
+             "promotion)"));
+
+// MemorySSA-aware versions of the entry points declared in LoopUtils.h. Those
+// keep their signatures for other users such as LoopSink, and forward here
+// with no MemorySSA.
+static bool sinkRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
+                       DominatorTree *DT, TargetLibraryInfo *TLI,
+                       Loop *CurLoop, AliasSetTracker *CurAST,
+                       LoopSafetyInfo *SafetyInfo,
+                       OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                       MemorySSAUpdater *MSSAU);
+static bool hoistRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
+                        DominatorTree *DT, TargetLibraryInfo *TLI,
+                        Loop *CurLoop, AliasSetTracker *CurAST,
+                        LoopSafetyInfo *SafetyInfo,
+                        OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                        MemorySSAUpdater *MSSAU);
+static bool canSinkOrHoistInst(Instruction &I, AAResults *AA,
+                               DominatorTree *DT, Loop *CurLoop,
+                               AliasSetTracker *CurAST,
+                               LoopSafetyInfo *SafetyInfo,
+                               OptimizationRemarkEmitter *ORE,
+                               MemorySSA *MSSA);
 static bool inSubLoop(BasicBlock *BB, Loop *CurLoop, LoopInfo *LI);
 static bool isNotUsedInLoop(const Instruction &I, const Loop *CurLoop,
                             const LoopSafetyInfo *SafetyInfo);
 static bool hoist(Instruction &I, const DominatorTree *DT, const Loop *CurLoop,
                   const LoopSafetyInfo *SafetyInfo,
-                  OptimizationRemarkEmitter *ORE);
+                  OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                  MemorySSAUpdater *MSSAU);
 static bool sink(Instruction &I, const LoopInfo *LI, const DominatorTree *DT,
                  const Loop *CurLoop, AliasSetTracker *CurAST,
                  const LoopSafetyInfo *SafetyInfo,
-                 OptimizationRemarkEmitter *ORE);
+                 OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                 MemorySSAUpdater *MSSAU);
 static bool isSafeToExecuteUnconditionally(Instruction &Inst,
                                            const DominatorTree *DT,
                                            const Loop *CurLoop,
@@ -106,6 +159,10 @@ static bool isSafeToExecuteUnconditionally(Instruction &Inst,
 static bool pointerInvalidatedByLoop(Value *V, uint64_t Size,
                                      const AAMDNodes &AAInfo,
                                      AliasSetTracker *CurAST);
+static bool pointerInvalidatedByLoopWithMSSA(MemorySSA *MSSA, MemoryUse *MU,
+                                             const Loop *CurLoop);
+static void removeFromAnalyses(Instruction &I, AliasSetTracker *CurAST,
+                               MemorySSA *MSSA, MemorySSAUpdater *MSSAU);
 static Instruction *
 CloneInstructionInExitBlock(Instruction &I, BasicBlock &ExitBlock, PHINode &PN,
                             const LoopInfo *LI,
@@ -115,7 +172,8 @@ namespace {
 struct LoopInvariantCodeMotion {
   bool runOnLoop(Loop *L, AliasAnalysis *AA, LoopInfo *LI, DominatorTree *DT,
                  TargetLibraryInfo *TLI, ScalarEvolution *SE,
-                 OptimizationRemarkEmitter *ORE, bool DeleteAST);
+                 OptimizationRemarkEmitter *ORE, bool DeleteAST,
+                 MemorySSA *MSSA = nullptr);
 
   DenseMap<Loop *, AliasSetTracker *> &getLoopToAliasSetMap() {
     return LoopToAliasSetMap;
@@ -150,12 +208,17 @@ struct LegacyLICMPass : public LoopPass {
     // pass.  Function analyses need to be preserved across loop transformations
     // but ORE cannot be preserved (see comment before the pass definition).
     OptimizationRemarkEmitter ORE(L->getHeader()->getParent());
+    // Only use a MemorySSA that every pass since it was computed preserved.
+    auto *MSSAWP = EnableLICMMemorySSA
+                       ? getAnalysisIfAvailable<MemorySSAWrapperPass>()
+                       : nullptr;
+    MemorySSA *MSSA = MSSAWP ? &MSSAWP->getMSSA() : nullptr;
     return LICM.runOnLoop(L,
                           &getAnalysis<AAResultsWrapperPass>().getAAResults(),
                           &getAnalysis<LoopInfoWrapperPass>().getLoopInfo(),
                           &getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
                           &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(),
-                          SE ? &SE->getSE() : nullptr, &ORE, false);
+                          SE ? &SE->getSE() : nullptr, &ORE, false, MSSA);
   }
 
   /// This transformation requires natural loop information & requires that
@@ -164,6 +227,10 @@ struct LegacyLICMPass : public LoopPass {
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.setPreservesCFG();
     AU.addRequired<TargetLibraryInfoWrapperPass>();
+    if (EnableLICMMemorySSA) {
+      AU.addUsedIfAvailable<MemorySSAWrapperPass>();
+      AU.addPreserved<MemorySSAWrapperPass>();
+    }
     getLoopAnalysisUsage(AU);
   }
 
@@ -227,18 +294,35 @@ Pass *llvm::createLICMPass() { return new LegacyLICMPass(); }
 /// times on one loop.
 /// We should delete AST for inner loops in the new pass manager to avoid
 /// memory leak.
+/// If MSSA is provided, no AST is built at all: memory invariance is queried
+/// from MemorySSA, which is updated as instructions are moved.
 ///
 bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,
                                         LoopInfo *LI, DominatorTree *DT,
                                         TargetLibraryInfo *TLI,
                                         ScalarEvolution *SE,
                                         OptimizationRemarkEmitter *ORE,
-                                        bool DeleteAST) {
+                                        bool DeleteAST, MemorySSA *MSSA) {
   bool Changed = false;
 
   assert(L->isLCSSAForm(*DT) && "Loop is not in LCSSA form.");
 
-  AliasSetTracker *CurAST = collectAliasInfoForLoop(L, LI, AA);
+  AliasSetTracker *CurAST = nullptr;
+  std::unique_ptr<MemorySSAUpdater> MSSAU;
+  if (MSSA) {
+    MSSAU = make_unique<MemorySSAUpdater>(MSSA);
+    // Subloops visited while no MemorySSA was available left their alias sets
+    // behind for this loop; they aren't needed.
+    for (Loop *InnerL : L->getSubLoops()) {
+      auto MapI = LoopToAliasSetMap.find(InnerL);
+      if (MapI == LoopToAliasSetMap.end())
+        continue;
+      delete MapI->second;
+      LoopToAliasSetMap.erase(MapI);
+    }
+  } else {
+    CurAST = collectAliasInfoForLoop(L, LI, AA);
+  }
 
   // Get the preheader block to move instructions into...
   BasicBlock *Preheader = L->getLoopPreheader();
@@ -259,10 +343,10 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,
   //
   if (L->hasDedicatedExits())
     Changed |= sinkRegion(DT->getNode(L->getHeader()), AA, LI, DT, TLI, L,
-                          CurAST, &SafetyInfo, ORE);
+                          CurAST, &SafetyInfo, ORE, MSSA, MSSAU.get());
   if (Preheader)
     Changed |= hoistRegion(DT->getNode(L->getHeader()), AA, LI, DT, TLI, L,
-                           CurAST, &SafetyInfo, ORE);
+                           CurAST, &SafetyInfo, ORE, MSSA, MSSAU.get());
 
   // Now that all loop invariants have been removed from the loop, promote any
   // memory references to scalars that we can.
@@ -271,7 +355,7 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,
   // make sure we catch that. An additional load may be generated in the
   // preheader for SSA updater, so also avoid sinking when no preheader
   // is available.
-  if (!DisablePromotion && Preheader && L->hasDedicatedExits()) {
+  if (!DisablePromotion && CurAST && Preheader && L->hasDedicatedExits()) {
     // Figure out the loop exits and their insertion points
     SmallVector<BasicBlock *, 8> ExitBlocks;
     L->getUniqueExitBlocks(ExitBlocks);
@@ -319,7 +403,7 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,
 
   // If this loop is nested inside of another one, save the alias information
   // for when we process the outer loop.
-  if (L->getParentLoop() && !DeleteAST)
+  if (CurAST && L->getParentLoop() && !DeleteAST)
     LoopToAliasSetMap[L] = CurAST;
   else
     delete CurAST;
@@ -338,11 +422,21 @@ bool llvm::sinkRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
                       DominatorTree *DT, TargetLibraryInfo *TLI, Loop *CurLoop,
                       AliasSetTracker *CurAST, LoopSafetyInfo *SafetyInfo,
                       OptimizationRemarkEmitter *ORE) {
+  return ::sinkRegion(N, AA, LI, DT, TLI, CurLoop, CurAST, SafetyInfo, ORE,
+                      nullptr, nullptr);
+}
+
+static bool sinkRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
+                       DominatorTree *DT, TargetLibraryInfo *TLI,
+                       Loop *CurLoop, AliasSetTracker *CurAST,
+                       LoopSafetyInfo *SafetyInfo,
+                       OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                       MemorySSAUpdater *MSSAU) {
 
   // Verify inputs.
   assert(N != nullptr && AA != nullptr && LI != nullptr && DT != nullptr &&
-         CurLoop != nullptr && CurAST != nullptr && SafetyInfo != nullptr &&
-         "Unexpected input to sinkRegion");
+         CurLoop != nullptr && (CurAST != nullptr || MSSAU != nullptr) &&
+         SafetyInfo != nullptr && "Unexpected input to sinkRegion");
 
   BasicBlock *BB = N->getBlock();
   // If this subregion is not in the top level loop at all, exit.
@@ -353,8 +447,8 @@ bool llvm::sinkRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
   bool Changed = false;
   const std::vector<DomTreeNode *> &Children = N->getChildren();
   for (DomTreeNode *Child : Children)
-    Changed |=
-        sinkRegion(Child, AA, LI, DT, TLI, CurLoop, CurAST, SafetyInfo, ORE);
+    Changed |= sinkRegion(Child, AA, LI, DT, TLI, CurLoop, CurAST, SafetyInfo,
+                          ORE, MSSA, MSSAU);
 
   // Only need to process the contents of this block if it is not part of a
   // subloop (which would already have been processed).
@@ -369,7 +463,7 @@ bool llvm::sinkRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
     if (isInstructionTriviallyDead(&I, TLI)) {
       DEBUG(dbgs() << "LICM deleting dead inst: " << I << '\n');
       ++II;
-      CurAST->deleteValue(&I);
+      removeFromAnalyses(I, CurAST, MSSA, MSSAU);
       I.eraseFromParent();
       Changed = true;
       continue;
@@ -381,9 +475,11 @@ bool llvm::sinkRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
     // operands of the instruction are loop invariant.
     //
     if (isNotUsedInLoop(I, CurLoop, SafetyInfo) &&
-        canSinkOrHoistInst(I, AA, DT, CurLoop, CurAST, SafetyInfo, ORE)) {
+        canSinkOrHoistInst(I, AA, DT, CurLoop, CurAST, SafetyInfo, ORE,
+                           MSSA)) {
       ++II;
-      Changed |= sink(I, LI, DT, CurLoop, CurAST, SafetyInfo, ORE);
+      Changed |=
+          sink(I, LI, DT, CurLoop, CurAST, SafetyInfo, ORE, MSSA, MSSAU);
     }
   }
   return Changed;
@@ -398,10 +494,20 @@ bool llvm::hoistRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
                        DominatorTree *DT, TargetLibraryInfo *TLI, Loop *CurLoop,
                        AliasSetTracker *CurAST, LoopSafetyInfo *SafetyInfo,
                        OptimizationRemarkEmitter *ORE) {
+  return ::hoistRegion(N, AA, LI, DT, TLI, CurLoop, CurAST, SafetyInfo, ORE,
+                       nullptr, nullptr);
+}
+
+static bool hoistRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
+                        DominatorTree *DT, TargetLibraryInfo *TLI,
+                        Loop *CurLoop, AliasSetTracker *CurAST,
+                        LoopSafetyInfo *SafetyInfo,
+                        OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                        MemorySSAUpdater *MSSAU) {
   // Verify inputs.
   assert(N != nullptr && AA != nullptr && LI != nullptr && DT != nullptr &&
-         CurLoop != nullptr && CurAST != nullptr && SafetyInfo != nullptr &&
-         "Unexpected input to hoistRegion");
+         CurLoop != nullptr && (CurAST != nullptr || MSSAU != nullptr) &&
+         SafetyInfo != nullptr && "Unexpected input to hoistRegion");
 
   BasicBlock *BB = N->getBlock();
 
@@ -421,10 +527,11 @@ bool llvm::hoistRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
       if (Constant *C = ConstantFoldInstruction(
               &I, I.getModule()->getDataLayout(), TLI)) {
         DEBUG(dbgs() << "LICM folding inst: " << I << "  --> " << *C << '\n');
-        CurAST->copyValue(&I, C);
+        if (CurAST)
+          CurAST->copyValue(&I, C);
         I.replaceAllUsesWith(C);
         if (isInstructionTriviallyDead(&I, TLI)) {
-          CurAST->deleteValue(&I);
+          removeFromAnalyses(I, CurAST, MSSA, MSSAU);
           I.eraseFromParent();
         }
         Changed = true;
@@ -449,7 +556,7 @@ bool llvm::hoistRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
         I.replaceAllUsesWith(Product);
         I.eraseFromParent();
 
-        hoist(*ReciprocalDivisor, DT, CurLoop, SafetyInfo, ORE);
+        hoist(*ReciprocalDivisor, DT, CurLoop, SafetyInfo, ORE, MSSA, MSSAU);
         Changed = true;
         continue;
       }
@@ -459,17 +566,18 @@ bool llvm::hoistRegion(DomTreeNode *N, AliasAnalysis *AA, LoopInfo *LI,
       // is safe to hoist the instruction.
       //
       if (CurLoop->hasLoopInvariantOperands(&I) &&
-          canSinkOrHoistInst(I, AA, DT, CurLoop, CurAST, SafetyInfo, ORE) &&
+          canSinkOrHoistInst(I, AA, DT, CurLoop, CurAST, SafetyInfo, ORE,
+                             MSSA) &&
           isSafeToExecuteUnconditionally(
               I, DT, CurLoop, SafetyInfo, ORE,
               CurLoop->getLoopPreheader()->getTerminator()))
-        Changed |= hoist(I, DT, CurLoop, SafetyInfo, ORE);
+        Changed |= hoist(I, DT, CurLoop, SafetyInfo, ORE, MSSA, MSSAU);
     }
 
   const std::vector<DomTreeNode *> &Children = N->getChildren();
   for (DomTreeNode *Child : Children)
-    Changed |=
-        hoistRegion(Child, AA, LI, DT, TLI, CurLoop, CurAST, SafetyInfo, ORE);
+    Changed |= hoistRegion(Child, AA, LI, DT, TLI, CurLoop, CurAST, SafetyInfo,
+                           ORE, MSSA, MSSAU);
   return Changed;
 }
 
@@ -566,6 +674,18 @@ bool llvm::canSinkOrHoistInst(Instruction &I, AAResults *AA, DominatorTree *DT,
                               Loop *CurLoop, AliasSetTracker *CurAST,
                               LoopSafetyInfo *SafetyInfo,
                               OptimizationRemarkEmitter *ORE) {
+  return ::canSinkOrHoistInst(I, AA, DT, CurLoop, CurAST, SafetyInfo, ORE,
+                              nullptr);
+}
+
+static bool canSinkOrHoistInst(Instruction &I, AAResults *AA,
+                               DominatorTree *DT, Loop *CurLoop,
+                               AliasSetTracker *CurAST,
+                               LoopSafetyInfo *SafetyInfo,
+                               OptimizationRemarkEmitter *ORE,
+                               MemorySSA *MSSA) {
+  assert((CurAST != nullptr || MSSA != nullptr) &&
+         "Need alias sets or MemorySSA to reason about memory");
   // Loads have extra constraints we have to verify before we can hoist them.
   if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
     if (!LI->isUnordered())
@@ -591,7 +711,10 @@ bool llvm::canSinkOrHoistInst(Instruction &I, AAResults *AA, DominatorTree *DT,
     LI->getAAMetadata(AAInfo);
 
     bool Invalidated =
-        pointerInvalidatedByLoop(LI->getOperand(0), Size, AAInfo, CurAST);
+        MSSA ? pointerInvalidatedByLoopWithMSSA(
+                   MSSA, cast<MemoryUse>(MSSA->getMemoryAccess(LI)), CurLoop)
+             : pointerInvalidatedByLoop(LI->getOperand(0), Size, AAInfo,
+                                        CurAST);
     // Check loop-invariant address because this may also be a sinkable load
     // whose address is not necessarily loop-invariant.
     if (ORE && Invalidated && CurLoop->isLoopInvariant(LI->getPointerOperand()))
@@ -615,6 +738,12 @@ bool llvm::canSinkOrHoistInst(Instruction &I, AAResults *AA, DominatorTree *DT,
     if (Behavior == FMRB_DoesNotAccessMemory)
       return true;
     if (AliasAnalysis::onlyReadsMemory(Behavior)) {
+      // MemorySSA's walker already asks alias analysis about the call itself,
+      // which covers both the argmemonly and the general readonly case.
+      if (MSSA)
+        return !pointerInvalidatedByLoopWithMSSA(
+            MSSA, cast<MemoryUse>(MSSA->getMemoryAccess(CI)), CurLoop);
+
       // A readonly argmemonly function only reads from memory pointed to by
       // it's arguments with arbitrary offsets.  If we can prove there are no
       // writes to this memory in the loop, we can hoist or sink.
@@ -795,7 +924,8 @@ CloneInstructionInExitBlock(Instruction &I, BasicBlock &ExitBlock, PHINode &PN,
 static bool sink(Instruction &I, const LoopInfo *LI, const DominatorTree *DT,
                  const Loop *CurLoop, AliasSetTracker *CurAST,
                  const LoopSafetyInfo *SafetyInfo,
-                 OptimizationRemarkEmitter *ORE) {
+                 OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                 MemorySSAUpdater *MSSAU) {
   DEBUG(dbgs() << "LICM sinking instruction: " << I << "\n");
   ORE->emit(OptimizationRemark(DEBUG_TYPE, "InstSunk", &I)
             << "sinking " << ore::NV("Inst", &I));
@@ -848,15 +978,22 @@ static bool sink(Instruction &I, const LoopInfo *LI, const DominatorTree *DT,
     auto It = SunkCopies.find(ExitBlock);
     if (It != SunkCopies.end())
       New = It->second;
-    else
+    else {
       New = SunkCopies[ExitBlock] =
           CloneInstructionInExitBlock(I, *ExitBlock, *PN, LI, SafetyInfo);
+      // Only loads and readonly calls get sunk, so the clone is always a use.
+      if (MSSAU && MSSA->getMemoryAccess(&I)) {
+        MemoryAccess *NewAccess = MSSAU->createMemoryAccessInBB(
+            New, nullptr, ExitBlock, MemorySSA::Beginning);
+        MSSAU->insertUse(cast<MemoryUse>(NewAccess));
+      }
+    }
 
     PN->replaceAllUsesWith(New);
     PN->eraseFromParent();
   }
 
-  CurAST->deleteValue(&I);
+  removeFromAnalyses(I, CurAST, MSSA, MSSAU);
   I.eraseFromParent();
   return Changed;
 }
@@ -866,7 +1003,8 @@ static bool sink(Instruction &I, const LoopInfo *LI, const DominatorTree *DT,
 ///
 static bool hoist(Instruction &I, const DominatorTree *DT, const Loop *CurLoop,
                   const LoopSafetyInfo *SafetyInfo,
-                  OptimizationRemarkEmitter *ORE) {
+                  OptimizationRemarkEmitter *ORE, MemorySSA *MSSA,
+                  MemorySSAUpdater *MSSAU) {
   auto *Preheader = CurLoop->getLoopPreheader();
   DEBUG(dbgs() << "LICM hoisting to " << Preheader->getName() << ": " << I
                << "\n");
@@ -886,6 +1024,16 @@ static bool hoist(Instruction &I, const DominatorTree *DT, const Loop *CurLoop,
 
   // Move the new node to the Preheader, before its terminator.
   I.moveBefore(Preheader->getTerminator());
+  // Give the hoisted use a new access at the end of the preheader (the
+  // terminator doesn't touch memory) and let the updater find its reaching
+  // definition there.
+  if (MSSAU)
+    if (MemoryUseOrDef *OldMemAcc = MSSA->getMemoryAccess(&I)) {
+      MemoryAccess *NewMemAcc = MSSAU->createMemoryAccessInBB(
+          &I, nullptr, Preheader, MemorySSA::End);
+      MSSAU->removeMemoryAccess(OldMemAcc);
+      MSSAU->insertUse(cast<MemoryUse>(NewMemAcc));
+    }
 
   // Do not retain debug locations when we are moving instructions to different
   // basic blocks, because we want to avoid jumpy line tables. Calls, however,
@@ -943,6 +1091,9 @@ class LoopPromoter : public LoadAndStorePromoter {
   int Alignment;
   bool UnorderedAtomic;
   AAMDNodes AATags;
+  /// If set, tracks whether a store has executed on the path to each exit
+  /// block, and the exit stores are only performed when it has.
+  SSAUpdater *DirtyFlag;
 
   Value *maybeInsertLCSSAPHI(Value *V, BasicBlock *BB) const {
     if (Instruction *I = dyn_cast<Instruction>(V))
@@ -965,11 +1116,12 @@ public:
                SmallVectorImpl<BasicBlock *> &LEB,
                SmallVectorImpl<Instruction *> &LIP, PredIteratorCache &PIC,
                AliasSetTracker &ast, LoopInfo &li, DebugLoc dl, int alignment,
-               bool UnorderedAtomic, const AAMDNodes &AATags)
+               bool UnorderedAtomic, const AAMDNodes &AATags,
+               SSAUpdater *DirtyFlag = nullptr)
       : LoadAndStorePromoter(Insts, S), SomePtr(SP), PointerMustAliases(PMA),
         LoopExitBlocks(LEB), LoopInsertPts(LIP), PredCache(PIC), AST(ast),
         LI(li), DL(std::move(dl)), Alignment(alignment),
-        UnorderedAtomic(UnorderedAtomic),AATags(AATags) {}
+        UnorderedAtomic(UnorderedAtomic),AATags(AATags), DirtyFlag(DirtyFlag) {}
 
   bool isInstInList(Instruction *I,
                     const SmallVectorImpl<Instruction *> &) const override {
@@ -992,6 +1144,23 @@ public:
       LiveInValue = maybeInsertLCSSAPHI(LiveInValue, ExitBlock);
       Value *Ptr = maybeInsertLCSSAPHI(SomePtr, ExitBlock);
       Instruction *InsertPos = LoopInsertPts[i];
+      if (DirtyFlag) {
+        // Write the value back only if the loop actually stored to it. LICM
+        // preserves the CFG, so use a single-lane masked store instead of a
+        // branch; codegen scalarizes it.
+        Value *Dirty = DirtyFlag->GetValueInMiddleOfBlock(ExitBlock);
+        Dirty = maybeInsertLCSSAPHI(Dirty, ExitBlock);
+        IRBuilder<> Builder(InsertPos);
+        Builder.SetCurrentDebugLocation(DL);
+        Type *VecTy = VectorType::get(LiveInValue->getType(), 1);
+        Value *Vec = Builder.CreateInsertElement(UndefValue::get(VecTy),
+                                                 LiveInValue, uint64_t(0));
+        Value *VecPtr = Builder.CreateBitCast(
+            Ptr, VecTy->getPointerTo(Ptr->getType()->getPointerAddressSpace()));
+        Builder.CreateMaskedStore(Vec, VecPtr, Alignment,
+                                  Builder.CreateVectorSplat(1, Dirty));
+        continue;
+      }
       StoreInst *NewSI = new StoreInst(LiveInValue, Ptr, InsertPos);
       if (UnorderedAtomic)
         NewSI->setOrdering(AtomicOrdering::Unordered);
@@ -1245,6 +1414,16 @@ bool llvm::promoteLoopAccessesToScalars(
     }
   }
 
+  // Neither a dominating store nor thread-locality lets us store on every
+  // path to the exits. We can still promote if the exit stores are made
+  // conditional on the loop having stored at all: every exit store then
+  // stands in for a store that did execute, so no new stores are introduced.
+  bool UseDirtyFlag = false;
+  if (!SafeToInsertStore && PromoteConditionalStores && !SawUnorderedAtomic &&
+      VectorType::isValidElementType(
+          SomePtr->getType()->getPointerElementType()))
+    SafeToInsertStore = UseDirtyFlag = true;
+
   // If we've still failed to prove we can sink the store, give up.
   if (!SafeToInsertStore)
     return false;
@@ -1256,6 +1435,8 @@ bool llvm::promoteLoopAccessesToScalars(
       OptimizationRemark(DEBUG_TYPE, "PromoteLoopAccessesToScalar", LoopUses[0])
       << "Moving accesses to memory location out of the loop");
   ++NumPromoted;
+  if (UseDirtyFlag)
+    ++NumPromotedConditional;
 
   // Grab a debug location for the inserted loads/stores; given that the
   // inserted loads/stores have little relation to the original loads/stores,
@@ -1266,9 +1447,25 @@ bool llvm::promoteLoopAccessesToScalars(
   // We use the SSAUpdater interface to insert phi nodes as required.
   SmallVector<PHINode *, 16> NewPHIs;
   SSAUpdater SSA(&NewPHIs);
+
+  // The dirty flag is false coming out of the preheader and true at the end
+  // of any block containing one of the stores.
+  SSAUpdater DirtyFlag;
+  if (UseDirtyFlag) {
+    LLVMContext &Ctx = Preheader->getContext();
+    DirtyFlag.Initialize(Type::getInt1Ty(Ctx),
+                         SomePtr->getName() + ".dirty");
+    DirtyFlag.AddAvailableValue(Preheader, ConstantInt::getFalse(Ctx));
+    for (Instruction *UI : LoopUses)
+      if (isa<StoreInst>(UI))
+        DirtyFlag.AddAvailableValue(UI->getParent(),
+                                    ConstantInt::getTrue(Ctx));
+  }
+
   LoopPromoter Promoter(SomePtr, LoopUses, SSA, PointerMustAliases, ExitBlocks,
                         InsertPts, PIC, *CurAST, *LI, DL, Alignment,
-                        SawUnorderedAtomic, AATags);
+                        SawUnorderedAtomic, AATags,
+                        UseDirtyFlag ? &DirtyFlag : nullptr);
 
   // Set up the preheader to have a definition of the value.  It is the live-out
   // value from the preheader that uses in the loop will use.
@@ -1388,6 +1585,29 @@ static bool pointerInvalidatedByLoop(Value *V, uint64_t Size,
   return CurAST->getAliasSetForPointer(V, Size, AAInfo).isMod();
 }
 
+/// Return true if something in the loop may clobber the memory read by MU,
+/// i.e. its nearest clobbering access lives inside the loop.
+///
+static bool pointerInvalidatedByLoopWithMSSA(MemorySSA *MSSA, MemoryUse *MU,
+                                             const Loop *CurLoop) {
+  ++NumMSSAQueries;
+  MemoryAccess *Source = MSSA->getWalker()->getClobberingMemoryAccess(MU);
+  return !MSSA->isLiveOnEntryDef(Source) &&
+         CurLoop->contains(Source->getBlock());
+}
+
+/// Forget I in whichever of the alias set tracker or MemorySSA is in use,
+/// ahead of I being erased.
+///
+static void removeFromAnalyses(Instruction &I, AliasSetTracker *CurAST,
+                               MemorySSA *MSSA, MemorySSAUpdater *MSSAU) {
+  if (CurAST)
+    CurAST->deleteValue(&I);
+  if (MSSAU)
+    if (MemoryUseOrDef *MUD = MSSA->getMemoryAccess(&I))
+      MSSAU->removeMemoryAccess(MUD);
+}
+
 /// Little predicate that returns true if the specified basic block is in
 /// a subloop of the current one, not the current one itself.
 ///
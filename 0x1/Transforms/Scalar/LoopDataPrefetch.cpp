@@ -37,6 +37,7 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 using namespace llvm;
 
@@ -59,7 +60,31 @@ static cl::opt<unsigned> MaxPrefetchIterationsAhead(
     "max-prefetch-iters-ahead",
     cl::desc("Max number of iterations to prefetch ahead"), cl::Hidden);
 
+// Measure the loop body in estimated cycles rather than in instructions when
+// dividing the prefetch distance into iterations, so that loops with slow
+// operations prefetch fewer iterations ahead than cheap loops of equal size.
+static cl::opt<bool> PrefetchLatencyDistance(
+    "loop-prefetch-latency-distance", cl::Hidden, cl::init(false),
+    cl::desc("Compute the prefetch distance of each loop from an estimate of "
+             "its body's latency"));
+
+static cl::opt<unsigned> PrefetchLoadLatency(
+    "loop-prefetch-load-latency", cl::Hidden, cl::init(4),
+    cl::desc("Cycles assumed for a cache-hitting load when estimating the "
+             "latency of a loop body"));
+
+static cl::opt<bool> PrefetchIndirect(
+    "loop-prefetch-indirect", cl::Hidden, cl::init(false),
+    cl::desc("Prefetch indirect accesses of the form a[b[i]]"));
+
+static cl::opt<bool> PrefetchUseTripCount(
+    "loop-prefetch-use-trip-count", cl::Hidden, cl::init(true),
+    cl::desc("Don't prefetch in loops whose known or profiled trip count is "
+             "no larger than the prefetch distance"));
+
 STATISTIC(NumPrefetches, "Number of prefetches inserted");
+STATISTIC(NumIndirectPrefetches, "Number of indirect prefetches inserted");
+STATISTIC(NumShortLoops, "Number of loops too short to prefetch in");
 
 namespace {
 
@@ -80,6 +105,15 @@ private:
   /// warrant a prefetch.
   bool isStrideLargeEnough(const SCEVAddRecExpr *AR);
 
+  /// \brief Estimate the number of cycles one iteration of \p L takes.
+  unsigned getLoopLatency(Loop *L,
+                          const SmallPtrSetImpl<const Value *> &EphValues);
+
+  /// \brief If \p MemI accesses a[b[i]], with b[i] a strided load, prefetch
+  /// a[b[i + ItersAhead]].  Return true if a prefetch was inserted.
+  bool insertIndirectPrefetch(Loop *L, Instruction *MemI, Value *PtrValue,
+                              unsigned ItersAhead);
+
   unsigned getMinPrefetchStride() {
     if (MinPrefetchStride.getNumOccurrences() > 0)
       return MinPrefetchStride;
@@ -200,6 +234,115 @@ bool LoopDataPrefetchLegacyPass::runOnFunction(Function &F) {
   return LDP.run();
 }
 
+unsigned LoopDataPrefetch::getLoopLatency(
+    Loop *L, const SmallPtrSetImpl<const Value *> &EphValues) {
+  unsigned Latency = 0;
+  for (const auto BB : L->blocks())
+    for (auto &I : *BB) {
+      if (EphValues.count(&I))
+        continue;
+      if (isa<LoadInst>(I))
+        Latency += PrefetchLoadLatency;
+      else
+        Latency += TTI->getUserCost(&I);
+    }
+  return Latency;
+}
+
+bool LoopDataPrefetch::insertIndirectPrefetch(Loop *L, Instruction *MemI,
+                                              Value *PtrValue,
+                                              unsigned ItersAhead) {
+  // Match a[(ext) b[i]], with everything but the index invariant in L.
+  auto *GEP = dyn_cast<GetElementPtrInst>(PtrValue);
+  if (!GEP || !L->contains(GEP) || GEP->getNumIndices() == 0)
+    return false;
+  for (unsigned Op = 0, E = GEP->getNumOperands() - 1; Op != E; ++Op)
+    if (!L->isLoopInvariant(GEP->getOperand(Op)))
+      return false;
+  Value *Idx = GEP->getOperand(GEP->getNumOperands() - 1);
+  auto *IdxCast = dyn_cast<CastInst>(Idx);
+  if (IdxCast && (isa<SExtInst>(IdxCast) || isa<ZExtInst>(IdxCast)))
+    Idx = IdxCast->getOperand(0);
+  else
+    IdxCast = nullptr;
+  auto *IdxLoad = dyn_cast<LoadInst>(Idx);
+  if (!IdxLoad || !IdxLoad->isSimple() || !L->contains(IdxLoad))
+    return false;
+
+  const SCEVAddRecExpr *IdxAR =
+      dyn_cast<SCEVAddRecExpr>(SE->getSCEV(IdxLoad->getPointerOperand()));
+  if (!IdxAR || IdxAR->getLoop() != L || !IdxAR->isAffine())
+    return false;
+  const SCEVConstant *Step =
+      dyn_cast<SCEVConstant>(IdxAR->getStepRecurrence(*SE));
+  if (!Step || Step->getValue()->isZero())
+    return false;
+
+  // The index is read ItersAhead iterations early, which is only safe if the
+  // loop is sure to read it itself later on.  Clamp it to the last iteration,
+  // and require the index load to run on every iteration until then: it has
+  // to be in the header of a loop that can only exit from its latch, and
+  // nothing may leave the loop by throwing.
+  const SCEV *BECount = SE->getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(BECount) ||
+      IdxLoad->getParent() != L->getHeader() ||
+      L->getExitingBlock() != L->getLoopLatch())
+    return false;
+  for (const auto BB : L->blocks())
+    for (auto &I : *BB)
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+        return false;
+
+  Type *StepTy = Step->getType();
+  const SCEV *NextIdxPtrS = SE->getAddExpr(
+      IdxAR, SE->getMulExpr(SE->getConstant(StepTy, ItersAhead), Step));
+  const SCEV *LastIdxPtrS = SE->getAddExpr(
+      IdxAR->getStart(),
+      SE->getMulExpr(SE->getTruncateOrZeroExtend(BECount, StepTy), Step));
+  if (!isSafeToExpand(NextIdxPtrS, *SE) || !isSafeToExpand(LastIdxPtrS, *SE))
+    return false;
+
+  Type *IdxPtrTy = IdxLoad->getPointerOperand()->getType();
+  SCEVExpander SCEVE(*SE, MemI->getModule()->getDataLayout(), "prefaddr");
+  Value *NextIdxPtr = SCEVE.expandCodeFor(NextIdxPtrS, IdxPtrTy, MemI);
+  Value *LastIdxPtr = SCEVE.expandCodeFor(LastIdxPtrS, IdxPtrTy, MemI);
+
+  IRBuilder<> Builder(MemI);
+  bool Forward = Step->getAPInt().isStrictlyPositive();
+  Value *InBounds = Forward ? Builder.CreateICmpULE(NextIdxPtr, LastIdxPtr)
+                            : Builder.CreateICmpUGE(NextIdxPtr, LastIdxPtr);
+  Value *IdxPtr = Builder.CreateSelect(InBounds, NextIdxPtr, LastIdxPtr);
+  LoadInst *NextIdx = Builder.CreateLoad(IdxPtr, "prefidx");
+  NextIdx->setAlignment(IdxLoad->getAlignment());
+  Value *NextIdxOp = NextIdx;
+  if (IdxCast)
+    NextIdxOp = Builder.CreateCast(IdxCast->getOpcode(), NextIdx,
+                                   IdxCast->getDestTy());
+
+  auto *NextGEP = cast<GetElementPtrInst>(GEP->clone());
+  NextGEP->setOperand(NextGEP->getNumOperands() - 1, NextIdxOp);
+  NextGEP->setName("prefaddr");
+  Builder.Insert(NextGEP);
+
+  unsigned PtrAddrSpace = PtrValue->getType()->getPointerAddressSpace();
+  Type *I8Ptr = Type::getInt8PtrTy(MemI->getContext(), PtrAddrSpace);
+  Module *M = MemI->getModule();
+  Type *I32 = Type::getInt32Ty(MemI->getContext());
+  Value *PrefetchFunc = Intrinsic::getDeclaration(M, Intrinsic::prefetch);
+  Builder.CreateCall(
+      PrefetchFunc,
+      {Builder.CreateBitCast(NextGEP, I8Ptr),
+       ConstantInt::get(I32, MemI->mayReadFromMemory() ? 0 : 1),
+       ConstantInt::get(I32, 3), ConstantInt::get(I32, 1)});
+  ++NumPrefetches;
+  ++NumIndirectPrefetches;
+  DEBUG(dbgs() << "  Indirect access: " << *PtrValue << ", index: "
+               << *IdxLoad << "\n");
+  ORE->emit(OptimizationRemark(DEBUG_TYPE, "PrefetchedIndirect", MemI)
+            << "prefetched indirect memory access");
+  return true;
+}
+
 bool LoopDataPrefetch::run() {
   // If PrefetchDistance is not set, don't run the pass.  This gives an
   // opportunity for targets to run this pass for selected subtargets only
@@ -240,7 +383,8 @@ bool LoopDataPrefetch::runOnLoop(Loop *L) {
 
     Metrics.analyzeBasicBlock(BB, *TTI, EphValues);
   }
-  unsigned LoopSize = Metrics.NumInsts;
+  unsigned LoopSize = PrefetchLatencyDistance ? getLoopLatency(L, EphValues)
+                                              : Metrics.NumInsts;
   if (!LoopSize)
     LoopSize = 1;
 
@@ -251,6 +395,21 @@ bool LoopDataPrefetch::runOnLoop(Loop *L) {
   if (ItersAhead > getMaxPrefetchIterationsAhead())
     return MadeChange;
 
+  // Prefetching ItersAhead iterations ahead mostly fetches past the end of a
+  // loop that doesn't run for longer than that.
+  if (PrefetchUseTripCount) {
+    unsigned TripCount = SE->getSmallConstantTripCount(L);
+    if (!TripCount)
+      if (Optional<unsigned> EstimatedTripCount = getLoopEstimatedTripCount(L))
+        TripCount = *EstimatedTripCount;
+    if (TripCount && TripCount <= ItersAhead) {
+      DEBUG(dbgs() << "Not prefetching in a loop of " << TripCount
+                   << " iterations: " << *L);
+      ++NumShortLoops;
+      return MadeChange;
+    }
+  }
+
   DEBUG(dbgs() << "Prefetching " << ItersAhead
                << " iterations ahead (loop size: " << LoopSize << ") in "
                << L->getHeader()->getParent()->getName() << ": " << *L);
@@ -279,8 +438,12 @@ bool LoopDataPrefetch::runOnLoop(Loop *L) {
 
       const SCEV *LSCEV = SE->getSCEV(PtrValue);
       const SCEVAddRecExpr *LSCEVAddRec = dyn_cast<SCEVAddRecExpr>(LSCEV);
-      if (!LSCEVAddRec)
+      if (!LSCEVAddRec) {
+        if (PrefetchIndirect &&
+            insertIndirectPrefetch(L, MemI, PtrValue, ItersAhead))
+          MadeChange = true;
         continue;
+      }
 
       // Check if the the stride of the accesses is large enough to warrant a
       // prefetch.
@@ -70,6 +70,8 @@ using namespace llvm;
 
 STATISTIC(NumMemSet, "Number of memset's formed from loop stores");
 STATISTIC(NumMemCpy, "Number of memcpy's formed from loop load+stores");
+STATISTIC(NumMemCpyFromMemCpy,
+          "Number of memcpy's formed from loop memcpy's");
 
 static cl::opt<bool> UseLIRCodeSizeHeurs(
     "use-lir-code-size-heurs",
@@ -132,8 +134,9 @@ private:
   bool processLoopStores(SmallVectorImpl<StoreInst *> &SL, const SCEV *BECount,
                          bool ForMemset);
   bool processLoopMemSet(MemSetInst *MSI, const SCEV *BECount);
+  bool processLoopMemCpy(MemCpyInst *MCI, const SCEV *BECount);
 
-  bool processLoopStridedStore(Value *DestPtr, unsigned StoreSize,
+  bool processLoopStridedStore(Value *DestPtr, const SCEV *StoreSizeSCEV,
                                unsigned StoreAlignment, Value *StoredVal,
                                Instruction *TheStore,
                                SmallPtrSetImpl<Instruction *> &Stores,
@@ -154,7 +157,7 @@ private:
                                PHINode *CntPhi, Value *Var);
   bool recognizeAndInsertCTLZ();
   void transformLoopToCountable(BasicBlock *PreCondBB, Instruction *CntInst,
-                                PHINode *CntPhi, Value *Var, const DebugLoc DL,
+                                PHINode *CntPhi, Value *Var, Instruction *DefX,
                                 bool ZeroCheck, bool IsCntPhiUsedOutsideLoop);
 
   /// @}
@@ -523,6 +526,19 @@ bool LoopIdiomRecognize::runOnLoopBlock(
         I = BB->begin();
       continue;
     }
+
+    // Likewise for memcpys, which typically come from an inner loop that has
+    // already been turned into one.
+    if (MemCpyInst *MCI = dyn_cast<MemCpyInst>(Inst)) {
+      WeakTrackingVH InstPtr(&*I);
+      if (!processLoopMemCpy(MCI, BECount))
+        continue;
+      MadeChange = true;
+
+      if (!InstPtr)
+        I = BB->begin();
+      continue;
+    }
   }
 
   return MadeChange;
@@ -657,9 +673,11 @@ bool LoopIdiomRecognize::processLoopStores(SmallVectorImpl<StoreInst *> &SL,
 
     bool NegStride = StoreSize == -Stride;
 
-    if (processLoopStridedStore(StorePtr, StoreSize, HeadStore->getAlignment(),
-                                StoredVal, HeadStore, AdjacentStores, StoreEv,
-                                BECount, NegStride)) {
+    const SCEV *StoreSizeSCEV =
+        SE->getConstant(DL->getIntPtrType(StorePtr->getType()), StoreSize);
+    if (processLoopStridedStore(StorePtr, StoreSizeSCEV,
+                                HeadStore->getAlignment(), StoredVal, HeadStore,
+                                AdjacentStores, StoreEv, BECount, NegStride)) {
       TransformedStores.insert(AdjacentStores.begin(), AdjacentStores.end());
       Changed = true;
     }
@@ -668,11 +686,52 @@ bool LoopIdiomRecognize::processLoopStores(SmallVectorImpl<StoreInst *> &SL,
   return Changed;
 }
 
+/// Check whether a memory intrinsic of length \p Length that accesses
+/// \p Ev on every iteration covers a contiguous block of memory over the
+/// whole loop, i.e. whether the stride of \p Ev is +/- \p Length.  The
+/// length need not be a constant: a loop invariant length equal to the
+/// stride is what an inner loop that has itself been turned into a memset or
+/// memcpy leaves behind when it walks the rows of a 2-D array without any
+/// padding.  On success, \p LengthSCEV is set to the length as a SCEV and
+/// \p NegStride to whether the accesses run backwards.
+static bool isContiguousAccess(const SCEVAddRecExpr *Ev, Value *Length,
+                               ScalarEvolution *SE, const SCEV *&LengthSCEV,
+                               bool &NegStride) {
+  const SCEV *Stride = Ev->getOperand(1);
+  if (auto *ConstLength = dyn_cast<ConstantInt>(Length)) {
+    // Reject lengths that are so large that they overflow an unsigned.
+    uint64_t SizeInBytes = ConstLength->getZExtValue();
+    if ((SizeInBytes >> 32) != 0)
+      return false;
+
+    const SCEVConstant *ConstStride = dyn_cast<SCEVConstant>(Stride);
+    if (!ConstStride)
+      return false;
+
+    APInt StrideVal = ConstStride->getAPInt();
+    if (SizeInBytes != StrideVal && SizeInBytes != -StrideVal)
+      return false;
+    NegStride = SizeInBytes == -StrideVal;
+    LengthSCEV = SE->getConstant(Stride->getType(), SizeInBytes);
+    return true;
+  }
+
+  if (!SE->isSCEVable(Length->getType()) ||
+      !SE->isLoopInvariant(SE->getSCEV(Length), Ev->getLoop()))
+    return false;
+  LengthSCEV = SE->getTruncateOrZeroExtend(SE->getSCEV(Length),
+                                           Stride->getType());
+  // A runtime length is only known to be positive, so only forward strides
+  // are handled.
+  NegStride = false;
+  return LengthSCEV == Stride;
+}
+
 /// processLoopMemSet - See if this memset can be promoted to a large memset.
 bool LoopIdiomRecognize::processLoopMemSet(MemSetInst *MSI,
                                            const SCEV *BECount) {
-  // We can only handle non-volatile memsets with a constant size.
-  if (MSI->isVolatile() || !isa<ConstantInt>(MSI->getLength()))
+  // We can only handle non-volatile memsets.
+  if (MSI->isVolatile())
     return false;
 
   // If we're not allowed to hack on memset, we fail.
@@ -688,19 +747,11 @@ bool LoopIdiomRecognize::processLoopMemSet(MemSetInst *MSI,
   if (!Ev || Ev->getLoop() != CurLoop || !Ev->isAffine())
     return false;
 
-  // Reject memsets that are so large that they overflow an unsigned.
-  uint64_t SizeInBytes = cast<ConstantInt>(MSI->getLength())->getZExtValue();
-  if ((SizeInBytes >> 32) != 0)
-    return false;
-
   // Check to see if the stride matches the size of the memset.  If so, then we
   // know that every byte is touched in the loop.
-  const SCEVConstant *ConstStride = dyn_cast<SCEVConstant>(Ev->getOperand(1));
-  if (!ConstStride)
-    return false;
-
-  APInt Stride = ConstStride->getAPInt();
-  if (SizeInBytes != Stride && SizeInBytes != -Stride)
+  const SCEV *SizeSCEV;
+  bool NegStride;
+  if (!isContiguousAccess(Ev, MSI->getLength(), SE, SizeSCEV, NegStride))
     return false;
 
   // Verify that the memset value is loop invariant.  If not, we can't promote
@@ -711,10 +762,9 @@ bool LoopIdiomRecognize::processLoopMemSet(MemSetInst *MSI,
 
   SmallPtrSet<Instruction *, 1> MSIs;
   MSIs.insert(MSI);
-  bool NegStride = SizeInBytes == -Stride;
-  return processLoopStridedStore(Pointer, (unsigned)SizeInBytes,
-                                 MSI->getAlignment(), SplatValue, MSI, MSIs, Ev,
-                                 BECount, NegStride, /*IsLoopMemset=*/true);
+  return processLoopStridedStore(Pointer, SizeSCEV, MSI->getAlignment(),
+                                 SplatValue, MSI, MSIs, Ev, BECount, NegStride,
+                                 /*IsLoopMemset=*/true);
 }
 
 /// mayLoopAccessLocation - Return true if the specified loop might access the
@@ -722,7 +772,7 @@ bool LoopIdiomRecognize::processLoopMemSet(MemSetInst *MSI,
 /// argument specifies what the verboten forms of access are (read or write).
 static bool
 mayLoopAccessLocation(Value *Ptr, ModRefInfo Access, Loop *L,
-                      const SCEV *BECount, unsigned StoreSize,
+                      const SCEV *BECount, const SCEV *StoreSizeSCEV,
                       AliasAnalysis &AA,
                       SmallPtrSetImpl<Instruction *> &IgnoredStores) {
   // Get the location that may be stored across the loop.  Since the access is
@@ -732,8 +782,11 @@ mayLoopAccessLocation(Value *Ptr, ModRefInfo Access, Loop *L,
 
   // If the loop iterates a fixed number of times, we can refine the access size
   // to be exactly the size of the memset, which is (BECount+1)*StoreSize
-  if (const SCEVConstant *BECst = dyn_cast<SCEVConstant>(BECount))
-    AccessSize = (BECst->getValue()->getZExtValue() + 1) * StoreSize;
+  const SCEVConstant *BECst = dyn_cast<SCEVConstant>(BECount);
+  const SCEVConstant *StoreSizeCst = dyn_cast<SCEVConstant>(StoreSizeSCEV);
+  if (BECst && StoreSizeCst)
+    AccessSize = (BECst->getValue()->getZExtValue() + 1) *
+                 StoreSizeCst->getValue()->getZExtValue();
 
   // TODO: For this to be really effective, we have to dive into the pointer
   // operand in the store.  Store to &A[i] of 100 will always return may alias
@@ -755,19 +808,37 @@ mayLoopAccessLocation(Value *Ptr, ModRefInfo Access, Loop *L,
 // we're trying to memset.  Therefore, we need to recompute the base pointer,
 // which is just Start - BECount*Size.
 static const SCEV *getStartForNegStride(const SCEV *Start, const SCEV *BECount,
-                                        Type *IntPtr, unsigned StoreSize,
+                                        Type *IntPtr,
+                                        const SCEV *StoreSizeSCEV,
                                         ScalarEvolution *SE) {
   const SCEV *Index = SE->getTruncateOrZeroExtend(BECount, IntPtr);
-  if (StoreSize != 1)
-    Index = SE->getMulExpr(Index, SE->getConstant(IntPtr, StoreSize),
+  if (!StoreSizeSCEV->isOne())
+    Index = SE->getMulExpr(Index,
+                           SE->getTruncateOrZeroExtend(StoreSizeSCEV, IntPtr),
                            SCEV::FlagNUW);
   return SE->getMinusSCEV(Start, Index);
 }
 
+/// The number of bytes accessed by a loop that accesses \p StoreSizeSCEV
+/// bytes on each of its (BECount+1) iterations, as a value of type \p IntPtr.
+static const SCEV *getNumBytes(const SCEV *BECount, Type *IntPtr,
+                               const SCEV *StoreSizeSCEV, ScalarEvolution *SE) {
+  // The # stored bytes is (BECount+1)*Size.  Expand the trip count out to
+  // pointer size if it isn't already.
+  BECount = SE->getTruncateOrZeroExtend(BECount, IntPtr);
+  const SCEV *NumBytesS =
+      SE->getAddExpr(BECount, SE->getOne(IntPtr), SCEV::FlagNUW);
+  if (!StoreSizeSCEV->isOne())
+    NumBytesS = SE->getMulExpr(
+        NumBytesS, SE->getTruncateOrZeroExtend(StoreSizeSCEV, IntPtr),
+        SCEV::FlagNUW);
+  return NumBytesS;
+}
+
 /// processLoopStridedStore - We see a strided store of some value.  If we can
 /// transform this into a memset or memset_pattern in the loop preheader, do so.
 bool LoopIdiomRecognize::processLoopStridedStore(
-    Value *DestPtr, unsigned StoreSize, unsigned StoreAlignment,
+    Value *DestPtr, const SCEV *StoreSizeSCEV, unsigned StoreAlignment,
     Value *StoredVal, Instruction *TheStore,
     SmallPtrSetImpl<Instruction *> &Stores, const SCEVAddRecExpr *Ev,
     const SCEV *BECount, bool NegStride, bool IsLoopMemset) {
@@ -794,11 +865,16 @@ bool LoopIdiomRecognize::processLoopStridedStore(
   const SCEV *Start = Ev->getStart();
   // Handle negative strided loops.
   if (NegStride)
-    Start = getStartForNegStride(Start, BECount, IntPtr, StoreSize, SE);
+    Start = getStartForNegStride(Start, BECount, IntPtr, StoreSizeSCEV, SE);
+
+  const SCEV *NumBytesS = getNumBytes(BECount, IntPtr, StoreSizeSCEV, SE);
 
   // TODO: ideally we should still be able to generate memset if SCEV expander
   // is taught to generate the dependencies at the latest point.
-  if (!isSafeToExpand(Start, *SE))
+  if (!isSafeToExpand(Start, *SE) || !isSafeToExpand(NumBytesS, *SE))
+    return false;
+
+  if (avoidLIRForMultiBlockLoop(/*IsMemset=*/true, IsLoopMemset))
     return false;
 
   // Okay, we have a strided store "p[i]" of a splattable value.  We can turn
@@ -808,35 +884,15 @@ bool LoopIdiomRecognize::processLoopStridedStore(
   // base pointer and checking the region.
   Value *BasePtr =
       Expander.expandCodeFor(Start, DestInt8PtrTy, Preheader->getTerminator());
-  if (mayLoopAccessLocation(BasePtr, MRI_ModRef, CurLoop, BECount, StoreSize,
-                            *AA, Stores)) {
+  if (mayLoopAccessLocation(BasePtr, MRI_ModRef, CurLoop, BECount,
+                            StoreSizeSCEV, *AA, Stores)) {
     Expander.clear();
     // If we generated new code for the base pointer, clean up.
     RecursivelyDeleteTriviallyDeadInstructions(BasePtr, TLI);
     return false;
   }
 
-  if (avoidLIRForMultiBlockLoop(/*IsMemset=*/true, IsLoopMemset))
-    return false;
-
   // Okay, everything looks good, insert the memset.
-
-  // The # stored bytes is (BECount+1)*Size.  Expand the trip count out to
-  // pointer size if it isn't already.
-  BECount = SE->getTruncateOrZeroExtend(BECount, IntPtr);
-
-  const SCEV *NumBytesS =
-      SE->getAddExpr(BECount, SE->getOne(IntPtr), SCEV::FlagNUW);
-  if (StoreSize != 1) {
-    NumBytesS = SE->getMulExpr(NumBytesS, SE->getConstant(IntPtr, StoreSize),
-                               SCEV::FlagNUW);
-  }
-
-  // TODO: ideally we should still be able to generate memset if SCEV expander
-  // is taught to generate the dependencies at the latest point.
-  if (!isSafeToExpand(NumBytesS, *SE))
-    return false;
-
   Value *NumBytes =
       Expander.expandCodeFor(NumBytesS, IntPtr, Preheader->getTerminator());
 
@@ -889,6 +945,8 @@ bool LoopIdiomRecognize::processLoopStoreOfLoopLoad(StoreInst *SI,
   APInt Stride = getStoreStride(StoreEv);
   unsigned StoreSize = getStoreSizeInBytes(SI, DL);
   bool NegStride = StoreSize == -Stride;
+  const SCEV *StoreSizeSCEV =
+      SE->getConstant(DL->getIntPtrType(StorePtr->getType()), StoreSize);
 
   // The store must be feeding a non-volatile load.
   LoadInst *LI = cast<LoadInst>(SI->getValueOperand());
@@ -913,7 +971,8 @@ bool LoopIdiomRecognize::processLoopStoreOfLoopLoad(StoreInst *SI,
 
   // Handle negative strided loops.
   if (NegStride)
-    StrStart = getStartForNegStride(StrStart, BECount, IntPtrTy, StoreSize, SE);
+    StrStart =
+        getStartForNegStride(StrStart, BECount, IntPtrTy, StoreSizeSCEV, SE);
 
   // Okay, we have a strided store "p[i]" of a loaded value.  We can turn
   // this into a memcpy in the loop preheader now if we want.  However, this
@@ -927,7 +986,7 @@ bool LoopIdiomRecognize::processLoopStoreOfLoopLoad(StoreInst *SI,
   SmallPtrSet<Instruction *, 1> Stores;
   Stores.insert(SI);
   if (mayLoopAccessLocation(StoreBasePtr, MRI_ModRef, CurLoop, BECount,
-                            StoreSize, *AA, Stores)) {
+                            StoreSizeSCEV, *AA, Stores)) {
     Expander.clear();
     // If we generated new code for the base pointer, clean up.
     RecursivelyDeleteTriviallyDeadInstructions(StoreBasePtr, TLI);
@@ -939,15 +998,16 @@ bool LoopIdiomRecognize::processLoopStoreOfLoopLoad(StoreInst *SI,
 
   // Handle negative strided loops.
   if (NegStride)
-    LdStart = getStartForNegStride(LdStart, BECount, IntPtrTy, StoreSize, SE);
+    LdStart =
+        getStartForNegStride(LdStart, BECount, IntPtrTy, StoreSizeSCEV, SE);
 
   // For a memcpy, we have to make sure that the input array is not being
   // mutated by the loop.
   Value *LoadBasePtr = Expander.expandCodeFor(
       LdStart, Builder.getInt8PtrTy(LdAS), Preheader->getTerminator());
 
-  if (mayLoopAccessLocation(LoadBasePtr, MRI_Mod, CurLoop, BECount, StoreSize,
-                            *AA, Stores)) {
+  if (mayLoopAccessLocation(LoadBasePtr, MRI_Mod, CurLoop, BECount,
+                            StoreSizeSCEV, *AA, Stores)) {
     Expander.clear();
     // If we generated new code for the base pointer, clean up.
     RecursivelyDeleteTriviallyDeadInstructions(LoadBasePtr, TLI);
@@ -959,16 +1019,7 @@ bool LoopIdiomRecognize::processLoopStoreOfLoopLoad(StoreInst *SI,
     return false;
 
   // Okay, everything is safe, we can transform this!
-
-  // The # stored bytes is (BECount+1)*Size.  Expand the trip count out to
-  // pointer size if it isn't already.
-  BECount = SE->getTruncateOrZeroExtend(BECount, IntPtrTy);
-
-  const SCEV *NumBytesS =
-      SE->getAddExpr(BECount, SE->getOne(IntPtrTy), SCEV::FlagNUW);
-  if (StoreSize != 1)
-    NumBytesS = SE->getMulExpr(NumBytesS, SE->getConstant(IntPtrTy, StoreSize),
-                               SCEV::FlagNUW);
+  const SCEV *NumBytesS = getNumBytes(BECount, IntPtrTy, StoreSizeSCEV, SE);
 
   Value *NumBytes =
       Expander.expandCodeFor(NumBytesS, IntPtrTy, Preheader->getTerminator());
@@ -989,6 +1040,97 @@ bool LoopIdiomRecognize::processLoopStoreOfLoopLoad(StoreInst *SI,
   return true;
 }
 
+/// See if this memcpy, which copies a contiguous block on every iteration, can
+/// be promoted to a single large memcpy.  This is the outer loop of a 2-D copy
+/// like for (i) for (j) A[i][j] = B[i][j]; once the inner loop is a memcpy.
+bool LoopIdiomRecognize::processLoopMemCpy(MemCpyInst *MCI,
+                                           const SCEV *BECount) {
+  if (MCI->isVolatile() || !HasMemcpy)
+    return false;
+
+  const SCEVAddRecExpr *StoreEv =
+      dyn_cast<SCEVAddRecExpr>(SE->getSCEV(MCI->getRawDest()));
+  const SCEVAddRecExpr *LoadEv =
+      dyn_cast<SCEVAddRecExpr>(SE->getSCEV(MCI->getRawSource()));
+  if (!StoreEv || StoreEv->getLoop() != CurLoop || !StoreEv->isAffine() ||
+      !LoadEv || LoadEv->getLoop() != CurLoop || !LoadEv->isAffine())
+    return false;
+
+  // Both sides have to walk contiguously through memory, in the same
+  // direction.
+  const SCEV *SizeSCEV, *LoadSizeSCEV;
+  bool NegStride, LoadNegStride;
+  if (!isContiguousAccess(StoreEv, MCI->getLength(), SE, SizeSCEV,
+                          NegStride) ||
+      !isContiguousAccess(LoadEv, MCI->getLength(), SE, LoadSizeSCEV,
+                          LoadNegStride) ||
+      SizeSCEV != LoadSizeSCEV || NegStride != LoadNegStride)
+    return false;
+
+  BasicBlock *Preheader = CurLoop->getLoopPreheader();
+  IRBuilder<> Builder(Preheader->getTerminator());
+  SCEVExpander Expander(*SE, *DL, "loop-idiom");
+
+  unsigned StrAS = MCI->getDestAddressSpace();
+  unsigned LdAS = MCI->getSourceAddressSpace();
+  Type *IntPtrTy = SizeSCEV->getType();
+
+  const SCEV *StrStart = StoreEv->getStart();
+  const SCEV *LdStart = LoadEv->getStart();
+  if (NegStride) {
+    StrStart = getStartForNegStride(StrStart, BECount, IntPtrTy, SizeSCEV, SE);
+    LdStart = getStartForNegStride(LdStart, BECount, IntPtrTy, SizeSCEV, SE);
+  }
+  const SCEV *NumBytesS = getNumBytes(BECount, IntPtrTy, SizeSCEV, SE);
+  if (!isSafeToExpand(StrStart, *SE) || !isSafeToExpand(LdStart, *SE) ||
+      !isSafeToExpand(NumBytesS, *SE))
+    return false;
+
+  // Bail out before anything is expanded into the preheader, so that only the
+  // alias checks below have to clean up after themselves.
+  if (avoidLIRForMultiBlockLoop())
+    return false;
+
+  // Nothing else in the loop may touch the destination, and nothing at all,
+  // not even the memcpy itself, may write the source: the rows are copied one
+  // by one, so an overlap between the two regions would change the result.
+  Value *StoreBasePtr = Expander.expandCodeFor(
+      StrStart, Builder.getInt8PtrTy(StrAS), Preheader->getTerminator());
+  SmallPtrSet<Instruction *, 1> Stores;
+  Stores.insert(MCI);
+  if (mayLoopAccessLocation(StoreBasePtr, MRI_ModRef, CurLoop, BECount,
+                            SizeSCEV, *AA, Stores)) {
+    Expander.clear();
+    RecursivelyDeleteTriviallyDeadInstructions(StoreBasePtr, TLI);
+    return false;
+  }
+
+  Value *LoadBasePtr = Expander.expandCodeFor(
+      LdStart, Builder.getInt8PtrTy(LdAS), Preheader->getTerminator());
+  SmallPtrSet<Instruction *, 1> NoStores;
+  if (mayLoopAccessLocation(LoadBasePtr, MRI_Mod, CurLoop, BECount, SizeSCEV,
+                            *AA, NoStores)) {
+    Expander.clear();
+    RecursivelyDeleteTriviallyDeadInstructions(LoadBasePtr, TLI);
+    RecursivelyDeleteTriviallyDeadInstructions(StoreBasePtr, TLI);
+    return false;
+  }
+
+  Value *NumBytes =
+      Expander.expandCodeFor(NumBytesS, IntPtrTy, Preheader->getTerminator());
+
+  CallInst *NewCall = Builder.CreateMemCpy(StoreBasePtr, LoadBasePtr, NumBytes,
+                                           MCI->getAlignment());
+  NewCall->setDebugLoc(MCI->getDebugLoc());
+
+  DEBUG(dbgs() << "  Formed memcpy: " << *NewCall << "\n"
+               << "    from memcpy: " << *MCI << "\n");
+
+  deleteDeadInstruction(MCI);
+  ++NumMemCpyFromMemCpy;
+  return true;
+}
+
 // When compiling for codesize we avoid idiom recognition for a multi-block loop
 // unless it is a loop_memset idiom or a memset/memcpy idiom in a nested loop.
 //
@@ -1206,6 +1348,9 @@ static bool detectPopcountIdiom(Loop *CurLoop, BasicBlock *PreCondBB,
 ///
 /// loop-exit:
 /// \endcode
+///
+/// The shift may be either arithmetic or logical; the latter is what unsigned
+/// types, such as the 64-bit words of a bitmap, give.
 static bool detectCTLZIdiom(Loop *CurLoop, PHINode *&PhiX,
                             Instruction *&CntInst, PHINode *&CntPhi,
                             Instruction *&DefX) {
@@ -1226,11 +1371,12 @@ static bool detectCTLZIdiom(Loop *CurLoop, PHINode *&PhiX,
     return false;
 
   // step 2: detect instructions corresponding to "x.next = x >> 1"
-  if (!DefX || DefX->getOpcode() != Instruction::AShr)
+  if (!DefX || (DefX->getOpcode() != Instruction::AShr &&
+                DefX->getOpcode() != Instruction::LShr))
+    return false;
+  ConstantInt *Shft = dyn_cast<ConstantInt>(DefX->getOperand(1));
+  if (!Shft || !Shft->isOne())
     return false;
-  if (ConstantInt *Shft = dyn_cast<ConstantInt>(DefX->getOperand(1)))
-    if (!Shft || !Shft->isOne())
-      return false;
   VarX = DefX->getOperand(0);
 
   // step 3: Check the recurrence of variable X
@@ -1336,8 +1482,7 @@ bool LoopIdiomRecognize::recognizeAndInsertCTLZ() {
           TargetTransformInfo::TCC_Basic)
     return false;
 
-  const DebugLoc DL = DefX->getDebugLoc();
-  transformLoopToCountable(PH, CntInst, CntPhi, InitX, DL, ZeroCheck,
+  transformLoopToCountable(PH, CntInst, CntPhi, InitX, DefX, ZeroCheck,
                            IsCntPhiUsedOutsideLoop);
   return true;
 }
@@ -1347,9 +1492,6 @@ bool LoopIdiomRecognize::recognizeAndInsertCTLZ() {
 /// If detected, transforms the relevant code to issue the popcount intrinsic
 /// function call, and returns true; otherwise, returns false.
 bool LoopIdiomRecognize::recognizePopcount() {
-  if (TTI->getPopcntSupport(32) != TargetTransformInfo::PSK_FastHardware)
-    return false;
-
   // Counting population are usually conducted by few arithmetic instructions.
   // Such instructions can be easily "absorbed" by vacant slots in a
   // non-compact loop. Therefore, recognizing popcount idiom only makes sense
@@ -1388,6 +1530,17 @@ bool LoopIdiomRecognize::recognizePopcount() {
   if (!detectPopcountIdiom(CurLoop, PreCondBB, CntInst, CntPhi, Val))
     return false;
 
+  // Ask about the width actually being counted; wider than native values are
+  // fine as long as the target counts their parts in hardware.
+  unsigned BitWidth = Val->getType()->getIntegerBitWidth();
+  if (TTI->getPopcntSupport(BitWidth) != TargetTransformInfo::PSK_FastHardware)
+    return false;
+
+  // The loop compares the trip count as a signed value of the counter's type,
+  // which has to be able to hold the count of a value with every bit set.
+  if (CntPhi->getType()->getIntegerBitWidth() < Log2_32(BitWidth) + 2)
+    return false;
+
   transformLoopToPopcount(PreCondBB, CntInst, CntPhi, Val);
   return true;
 }
@@ -1451,7 +1604,8 @@ static CallInst *createCTLZIntrinsic(IRBuilder<> &IRBuilder, Value *Val,
 /// If CntInst and DefX are not used in LOOP_BODY they will be removed.
 void LoopIdiomRecognize::transformLoopToCountable(
     BasicBlock *Preheader, Instruction *CntInst, PHINode *CntPhi, Value *InitX,
-    const DebugLoc DL, bool ZeroCheck, bool IsCntPhiUsedOutsideLoop) {
+    Instruction *DefX, bool ZeroCheck, bool IsCntPhiUsedOutsideLoop) {
+  const DebugLoc DL = DefX->getDebugLoc();
   BranchInst *PreheaderBr = dyn_cast<BranchInst>(Preheader->getTerminator());
 
   // Step 1: Insert the CTLZ instruction at the end of the preheader block
@@ -1463,8 +1617,9 @@ void LoopIdiomRecognize::transformLoopToCountable(
   Value *CTLZ, *Count, *CountPrev, *NewCount, *InitXNext;
 
   if (IsCntPhiUsedOutsideLoop)
-    InitXNext = Builder.CreateAShr(InitX,
-                                   ConstantInt::get(InitX->getType(), 1));
+    InitXNext = Builder.CreateBinOp(cast<BinaryOperator>(DefX)->getOpcode(),
+                                    InitX,
+                                    ConstantInt::get(InitX->getType(), 1));
   else
     InitXNext = InitX;
   CTLZ = createCTLZIntrinsic(Builder, InitXNext, DL, ZeroCheck);
@@ -65,6 +65,7 @@
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/IVUsers.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopPass.h"
@@ -96,6 +97,7 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
@@ -115,6 +117,16 @@ using namespace llvm;
 
 #define DEBUG_TYPE "loop-reduce"
 
+STATISTIC(NumFormulaeGenerated, "Number of LSR formulae generated");
+STATISTIC(NumFormulaePruned,
+          "Number of LSR formulae pruned before solving");
+STATISTIC(NumSolverSteps, "Number of formulae rated by the LSR solver");
+STATISTIC(NumSolverMemoPrunes,
+          "Number of LSR partial solutions pruned by an earlier, cheaper one "
+          "with the same registers");
+STATISTIC(NumSolverBudgetExceeded,
+          "Number of loops whose LSR search ran out of budget");
+
 /// MaxIVUsers is an arbitrary threshold that provides an early opportunitiy for
 /// bail out. This threshold is far beyond the number of users that LSR can
 /// conceivably solve, so it should not affect generated code, but catches the
@@ -140,6 +152,26 @@ static cl::opt<bool> LSRExpNarrow(
   cl::desc("Narrow LSR complex solution using"
            " expectation of registers number"));
 
+// Upper bound on the estimated number of solutions before the search space is
+// narrowed with heuristics.
+static cl::opt<unsigned> ComplexityLimit(
+  "lsr-complexity-limit", cl::Hidden, cl::init(UINT16_MAX),
+  cl::desc("LSR search space complexity limit"));
+
+// The solver gives up on an exhaustive search after rating this many formulae,
+// and uses the best solution found so far.
+static cl::opt<unsigned> SolveBudget(
+  "lsr-solve-budget", cl::Hidden, cl::init(1u << 18),
+  cl::desc("Max number of formulae the LSR solver may rate per loop"));
+
+static cl::opt<bool> SolveMemo(
+  "lsr-solve-memo", cl::Hidden, cl::init(true),
+  cl::desc("Prune LSR partial solutions that reach a register set already "
+           "reached at lower cost"));
+
+static const char *const LSRTimerGroupName = "loop-reduce";
+static const char *const LSRTimerGroupDescription = "Loop Strength Reduction";
+
 #ifndef NDEBUG
 // Stress test IV chain generation.
 static cl::opt<bool> StressIVChain(
@@ -1903,12 +1935,24 @@ class LSRInstance {
   void NarrowSearchSpaceByPickingWinnerRegs();
   void NarrowSearchSpaceUsingHeuristics();
 
+  /// Bookkeeping for one run of the solver.
+  struct SolverState {
+    /// The number of formulae that may still be rated.
+    unsigned StepsLeft;
+    /// The cheapest cost at which each (number of uses solved, sorted
+    /// register set) has been reached so far.
+    std::map<std::pair<size_t, SmallVector<const SCEV *, 16>>, Cost> BestCost;
+  };
+
   void SolveRecurse(SmallVectorImpl<const Formula *> &Solution,
                     Cost &SolutionCost,
                     SmallVectorImpl<const Formula *> &Workspace,
                     const Cost &CurCost,
                     const SmallPtrSet<const SCEV *, 16> &CurRegs,
-                    DenseSet<const SCEV *> &VisitedRegs) const;
+                    DenseSet<const SCEV *> &VisitedRegs,
+                    SolverState &State) const;
+  void SolveGreedily(SmallVectorImpl<const Formula *> &Solution,
+                     Cost &SolutionCost) const;
   void Solve(SmallVectorImpl<const Formula *> &Solution) const;
 
   BasicBlock::iterator
@@ -3243,6 +3287,7 @@ bool LSRInstance::InsertFormula(LSRUse &LU, unsigned LUIdx, const Formula &F) {
     return false;
 
   CountRegisters(F, LUIdx);
+  ++NumFormulaeGenerated;
   return true;
 }
 
@@ -4136,9 +4181,6 @@ void LSRInstance::FilterOutUndesirableDedicatedRegisters() {
         });
 }
 
-// This is a rough guess that seems to work fairly well.
-static const size_t ComplexityLimit = UINT16_MAX;
-
 /// Estimate the worst-case number of solutions the solver might have to
 /// consider. It almost never considers this many solutions because it prune the
 /// search space, but the pruning isn't always sufficient.
@@ -4525,7 +4567,8 @@ void LSRInstance::SolveRecurse(SmallVectorImpl<const Formula *> &Solution,
                                SmallVectorImpl<const Formula *> &Workspace,
                                const Cost &CurCost,
                                const SmallPtrSet<const SCEV *, 16> &CurRegs,
-                               DenseSet<const SCEV *> &VisitedRegs) const {
+                               DenseSet<const SCEV *> &VisitedRegs,
+                               SolverState &State) const {
   // Some ideas:
   //  - prune more:
   //    - use more aggressive filtering
@@ -4536,6 +4579,30 @@ void LSRInstance::SolveRecurse(SmallVectorImpl<const Formula *> &Solution,
   //      and bail early.
   //    - track register sets with SmallBitVector
 
+  if (!State.StepsLeft)
+    return;
+
+  // Every cost component but the instruction count grows by an amount that
+  // only depends on the formula and the registers already in use. So if this
+  // register set was already reached at the same depth for no more than the
+  // current cost, nothing below this point can beat what was found from there.
+  // The instruction count is a non-linear function of the register count, so
+  // this doesn't hold when it is part of the cost.
+  if (SolveMemo && !InsnsCost && !Workspace.empty()) {
+    SmallVector<const SCEV *, 16> Key(CurRegs.begin(), CurRegs.end());
+    std::sort(Key.begin(), Key.end());
+    auto Ins = State.BestCost.insert(
+        std::make_pair(std::make_pair(Workspace.size(), std::move(Key)),
+                       CurCost));
+    if (!Ins.second) {
+      if (!(CurCost < Ins.first->second)) {
+        ++NumSolverMemoPrunes;
+        return;
+      }
+      Ins.first->second = CurCost;
+    }
+  }
+
   const LSRUse &LU = Uses[Workspace.size()];
 
   // If this use references any register that's already a part of the
@@ -4568,6 +4635,12 @@ void LSRInstance::SolveRecurse(SmallVectorImpl<const Formula *> &Solution,
       continue;
     }
 
+    // Out of budget; keep whatever has been found so far.
+    if (!State.StepsLeft)
+      return;
+    --State.StepsLeft;
+    ++NumSolverSteps;
+
     // Evaluate the cost of the current formula. If it's already worse than
     // the current best, prune the search at that point.
     NewCost = CurCost;
@@ -4577,7 +4650,7 @@ void LSRInstance::SolveRecurse(SmallVectorImpl<const Formula *> &Solution,
       Workspace.push_back(&F);
       if (Workspace.size() != Uses.size()) {
         SolveRecurse(Solution, SolutionCost, Workspace, NewCost,
-                     NewRegs, VisitedRegs);
+                     NewRegs, VisitedRegs, State);
         if (F.getNumRegs() == 1 && Workspace.size() == 1)
           VisitedRegs.insert(F.ScaledReg ? F.ScaledReg : F.BaseRegs[0]);
       } else {
@@ -4595,9 +4668,45 @@ void LSRInstance::SolveRecurse(SmallVectorImpl<const Formula *> &Solution,
   }
 }
 
+/// Pick the cheapest formula for each use in turn, given the registers chosen
+/// for the uses before it. This is the fallback for when the search runs out
+/// of budget before finding any complete solution.
+void LSRInstance::SolveGreedily(SmallVectorImpl<const Formula *> &Solution,
+                                Cost &SolutionCost) const {
+  Cost CurCost;
+  SmallPtrSet<const SCEV *, 16> CurRegs;
+  DenseSet<const SCEV *> VisitedRegs;
+  for (const LSRUse &LU : Uses) {
+    const Formula *Best = nullptr;
+    Cost BestCost;
+    BestCost.Lose();
+    SmallPtrSet<const SCEV *, 16> BestRegs;
+    for (const Formula &F : LU.Formulae) {
+      Cost NewCost = CurCost;
+      SmallPtrSet<const SCEV *, 16> NewRegs = CurRegs;
+      NewCost.RateFormula(TTI, F, NewRegs, VisitedRegs, L, SE, DT, LU);
+      if (NewCost < BestCost) {
+        Best = &F;
+        BestCost = NewCost;
+        BestRegs = NewRegs;
+      }
+    }
+    if (!Best) {
+      Solution.clear();
+      return;
+    }
+    Solution.push_back(Best);
+    CurCost = BestCost;
+    CurRegs = BestRegs;
+  }
+  SolutionCost = CurCost;
+}
+
 /// Choose one formula from each use. Return the results in the given Solution
 /// vector.
 void LSRInstance::Solve(SmallVectorImpl<const Formula *> &Solution) const {
+  NamedRegionTimer T("solve", "LSR solver", LSRTimerGroupName,
+                     LSRTimerGroupDescription, TimePassesIsEnabled);
   SmallVector<const Formula *, 8> Workspace;
   Cost SolutionCost;
   SolutionCost.Lose();
@@ -4605,10 +4714,20 @@ void LSRInstance::Solve(SmallVectorImpl<const Formula *> &Solution) const {
   SmallPtrSet<const SCEV *, 16> CurRegs;
   DenseSet<const SCEV *> VisitedRegs;
   Workspace.reserve(Uses.size());
+  SolverState State;
+  State.StepsLeft = SolveBudget;
 
   // SolveRecurse does all the work.
   SolveRecurse(Solution, SolutionCost, Workspace, CurCost,
-               CurRegs, VisitedRegs);
+               CurRegs, VisitedRegs, State);
+  if (!State.StepsLeft) {
+    ++NumSolverBudgetExceeded;
+    DEBUG(dbgs() << "\nLSR solver ran out of budget; using the "
+                 << (Solution.empty() ? "greedy" : "best found")
+                 << " solution\n");
+    if (Solution.empty())
+      SolveGreedily(Solution, SolutionCost);
+  }
   if (Solution.empty()) {
     DEBUG(dbgs() << "\nNo Satisfactory Solution\n");
     return;
@@ -5162,10 +5281,28 @@ LSRInstance::LSRInstance(Loop *L, IVUsers &IU, ScalarEvolution &SE,
 
   // Now use the reuse data to generate a bunch of interesting ways
   // to formulate the values needed for the uses.
-  GenerateAllReuseFormulae();
-
-  FilterOutUndesirableDedicatedRegisters();
-  NarrowSearchSpaceUsingHeuristics();
+  {
+    NamedRegionTimer T("generate", "LSR formula generation",
+                       LSRTimerGroupName, LSRTimerGroupDescription,
+                       TimePassesIsEnabled);
+    GenerateAllReuseFormulae();
+  }
+
+  {
+    NamedRegionTimer T("narrow", "LSR search space narrowing",
+                       LSRTimerGroupName, LSRTimerGroupDescription,
+                       TimePassesIsEnabled);
+    auto CountFormulae = [&]() {
+      size_t N = 0;
+      for (const LSRUse &LU : Uses)
+        N += LU.Formulae.size();
+      return N;
+    };
+    size_t NumGenerated = CountFormulae();
+    FilterOutUndesirableDedicatedRegisters();
+    NarrowSearchSpaceUsingHeuristics();
+    NumFormulaePruned += NumGenerated - CountFormulae();
+  }
 
   SmallVector<const Formula *, 8> Solution;
   Solve(Solution);
@@ -5188,6 +5325,8 @@ LSRInstance::LSRInstance(Loop *L, IVUsers &IU, ScalarEvolution &SE,
 #endif
 
   // Now that we've decided what we want, make it so.
+  NamedRegionTimer T("implement", "LSR solution rewriting", LSRTimerGroupName,
+                     LSRTimerGroupDescription, TimePassesIsEnabled);
   ImplementSolution(Solution);
 }
 
@@ -14,6 +14,7 @@
 
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/iterator_range.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/STLExtras.h"
@@ -24,6 +25,7 @@
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Argument.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -45,6 +47,7 @@
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
@@ -61,9 +64,16 @@ using namespace llvm;
 
 STATISTIC(NumMemCpyInstr, "Number of memcpy instructions deleted");
 STATISTIC(NumMemSetInfer, "Number of memsets inferred");
+STATISTIC(NumMemSetInferCrossBlock,
+          "Number of memsets inferred from stores in more than one block");
 STATISTIC(NumMoveToCpy,   "Number of memmoves converted to memcpy");
 STATISTIC(NumCpyToSet,    "Number of memcpys converted to memset");
 
+static cl::opt<unsigned> MemsetMergeBlockLimit(
+    "memcpyopt-memset-merge-blocks", cl::init(4), cl::Hidden,
+    cl::desc("Max number of later blocks to scan for stores that can be "
+             "merged into a memset"));
+
 static int64_t GetOffsetFromIndex(const GEPOperator *GEP, unsigned Idx,
                                   bool &VariableIdxFound,
                                   const DataLayout &DL) {
@@ -374,6 +384,55 @@ INITIALIZE_PASS_DEPENDENCY(GlobalsAAWrapperPass)
 INITIALIZE_PASS_END(MemCpyOptLegacyPass, "memcpyopt", "MemCpy Optimization",
                     false, false)
 
+/// Return the block in which a scan for stores to merge into a memset may
+/// continue once it reaches the end of BB, or null if there is none. That
+/// block must run whenever BB does, and be reached from BB without touching
+/// memory: either BB's only successor, with BB as its only predecessor, or
+/// the join of a triangle or diamond whose side blocks have no side effects
+/// and don't read memory. BlocksLeft is charged for every block stepped into.
+static BasicBlock *getMemsetMergeSuccessor(BasicBlock *BB,
+                                           unsigned &BlocksLeft) {
+  TerminatorInst *TI = BB->getTerminator();
+  if (!isa<BranchInst>(TI) && !isa<SwitchInst>(TI))
+    return nullptr;
+
+  if (BasicBlock *Succ = BB->getUniqueSuccessor()) {
+    if (!BlocksLeft || Succ == BB || Succ->getSinglePredecessor() != BB)
+      return nullptr;
+    --BlocksLeft;
+    return Succ;
+  }
+
+  // Otherwise every successor is either the join block, or a side block that
+  // only does arithmetic and falls through to it.
+  BasicBlock *Join = nullptr;
+  SmallPtrSet<BasicBlock *, 4> Sides;
+  for (BasicBlock *Succ : successors(BB)) {
+    if (Succ == BB)
+      return nullptr;
+    BasicBlock *Next = Succ->getUniqueSuccessor();
+    bool IsSide = Succ->getSinglePredecessor() == BB && Next && Next != BB &&
+                  Next != Succ && isa<BranchInst>(Succ->getTerminator()) &&
+                  none_of(*Succ, [](Instruction &I) {
+                    return I.mayHaveSideEffects() || I.mayReadFromMemory();
+                  });
+    BasicBlock *Target = IsSide ? Next : Succ;
+    if (Join && Target != Join)
+      return nullptr;
+    Join = Target;
+    if (IsSide)
+      Sides.insert(Succ);
+  }
+
+  if (!Join || Join == BB || BlocksLeft < Sides.size() + 1)
+    return nullptr;
+  for (BasicBlock *Pred : predecessors(Join))
+    if (Pred != BB && !Sides.count(Pred))
+      return nullptr;
+  BlocksLeft -= Sides.size() + 1;
+  return Join;
+}
+
 /// When scanning forward over instructions, we look for some other patterns to
 /// fold away. In particular, this looks for stores to neighboring locations of
 /// memory. If it sees enough consecutive ones, it attempts to merge them
@@ -389,8 +448,24 @@ Instruction *MemCpyOptPass::tryMergingIntoMemset(Instruction *StartInst,
   // are stored.
   MemsetRanges Ranges(DL);
 
+  // The scan may carry on into later blocks, as long as they run whenever
+  // this one does; the memset then goes into the last block scanned. Blocks
+  // in an unreachable cycle can lead back to one already scanned, which would
+  // collect the same stores twice, so stop there.
+  unsigned BlocksLeft = MemsetMergeBlockLimit;
+  SmallPtrSet<BasicBlock *, 8> Scanned;
+  Scanned.insert(StartInst->getParent());
   BasicBlock::iterator BI(StartInst);
-  for (++BI; !isa<TerminatorInst>(BI); ++BI) {
+  for (++BI;; ++BI) {
+    while (isa<TerminatorInst>(BI)) {
+      BasicBlock *Next = getMemsetMergeSuccessor(BI->getParent(), BlocksLeft);
+      if (!Next || !Scanned.insert(Next).second)
+        break;
+      BI = Next->getFirstNonPHI()->getIterator();
+    }
+    if (isa<TerminatorInst>(BI))
+      break;
+
     if (!isa<StoreInst>(BI) && !isa<MemSetInst>(BI)) {
       // If the instruction is readnone, ignore it, otherwise bail out.  We
       // don't even allow readonly here because we don't want something like:
@@ -480,6 +555,11 @@ Instruction *MemCpyOptPass::tryMergingIntoMemset(Instruction *StartInst,
     if (!Range.TheStores.empty())
       AMemSet->setDebugLoc(Range.TheStores[0]->getDebugLoc());
 
+    if (any_of(Range.TheStores, [&](Instruction *SI) {
+          return SI->getParent() != AMemSet->getParent();
+        }))
+      ++NumMemSetInferCrossBlock;
+
     // Zap all the stores.
     for (Instruction *SI : Range.TheStores) {
       MD->removeInstruction(SI);
@@ -734,9 +814,13 @@ bool MemCpyOptPass::processStore(StoreInst *SI, BasicBlock::iterator &BBI) {
   // 0xA0A0A0A0 and 0.0.
   auto *V = SI->getOperand(0);
   if (Value *ByteVal = isBytewiseValue(V)) {
+    BasicBlock *BB = SI->getParent();
     if (Instruction *I = tryMergingIntoMemset(SI, SI->getPointerOperand(),
                                               ByteVal)) {
-      BBI = I->getIterator(); // Don't invalidate iterator.
+      // Don't invalidate iterator. If the memset went into a later block,
+      // everything left in this one was scanned over, so skip to its end.
+      BBI = I->getParent() == BB ? I->getIterator()
+                                 : BB->getTerminator()->getIterator();
       return true;
     }
 
@@ -771,12 +855,16 @@ bool MemCpyOptPass::processStore(StoreInst *SI, BasicBlock::iterator &BBI) {
 bool MemCpyOptPass::processMemSet(MemSetInst *MSI, BasicBlock::iterator &BBI) {
   // See if there is another memset or store neighboring this memset which
   // allows us to widen out the memset to do a single larger store.
-  if (isa<ConstantInt>(MSI->getLength()) && !MSI->isVolatile())
+  if (isa<ConstantInt>(MSI->getLength()) && !MSI->isVolatile()) {
+    BasicBlock *BB = MSI->getParent();
     if (Instruction *I = tryMergingIntoMemset(MSI, MSI->getDest(),
                                               MSI->getValue())) {
-      BBI = I->getIterator(); // Don't invalidate iterator.
+      // Don't invalidate iterator; see processStore.
+      BBI = I->getParent() == BB ? I->getIterator()
+                                 : BB->getTerminator()->getIterator();
       return true;
     }
+  }
   return false;
 }
 
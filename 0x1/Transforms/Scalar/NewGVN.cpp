@@ -87,7 +87,9 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/DebugCounter.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Scalar/GVNExpression.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Local.h"
@@ -117,6 +119,10 @@ STATISTIC(NumGVNDeadStores, "Number of redundant/dead stores eliminated");
 STATISTIC(NumGVNPHIOfOpsCreated, "Number of PHI of ops created");
 STATISTIC(NumGVNPHIOfOpsEliminations,
           "Number of things eliminated using PHI of ops");
+STATISTIC(NumGVNValuesProcessed,
+          "Number of values processed while finding the fixpoint");
+STATISTIC(NumGVNBudgetExceeded,
+          "Number of functions abandoned because the fixpoint budget ran out");
 DEBUG_COUNTER(VNCounter, "newgvn-vn",
               "Controls which instructions are value numbered")
 DEBUG_COUNTER(PHIOfOpsCounter, "newgvn-phi",
@@ -127,6 +133,23 @@ DEBUG_COUNTER(PHIOfOpsCounter, "newgvn-phi",
 static cl::opt<bool> EnableStoreRefinement("enable-store-refinement",
                                            cl::init(false), cl::Hidden);
 
+// The optimistic fixpoint normally converges in a handful of iterations, but
+// pathological functions can take far longer than classic GVN would.  These
+// limits bound the work done per function; when either is hit, NewGVN leaves
+// the function alone (the new pass manager runs classic GVN instead).
+static cl::opt<unsigned> MaxIterations(
+    "newgvn-max-iterations", cl::init(64), cl::Hidden,
+    cl::desc("Maximum number of fixpoint iterations NewGVN performs on a "
+             "function before giving up (0 = unlimited)"));
+
+static cl::opt<unsigned> MaxProcessedPerInst(
+    "newgvn-max-processed-per-inst", cl::init(32), cl::Hidden,
+    cl::desc("Maximum number of times, on average, NewGVN may value number "
+             "each instruction before giving up (0 = unlimited)"));
+
+static const char *const NewGVNTimerGroupName = "newgvn";
+static const char *const NewGVNTimerGroupDescription = "NewGVN";
+
 //===----------------------------------------------------------------------===//
 //                                GVN Pass
 //===----------------------------------------------------------------------===//
@@ -556,6 +579,9 @@ class NewGVN {
   // Deletion info.
   SmallPtrSet<Instruction *, 8> InstructionsToErase;
 
+  // Set when iterateTouchedInstructions ran out of budget.
+  bool BudgetExceeded = false;
+
 public:
   NewGVN(Function &F, DominatorTree *DT, AssumptionCache *AC,
          TargetLibraryInfo *TLI, AliasAnalysis *AA, MemorySSA *MSSA,
@@ -564,6 +590,9 @@ public:
         PredInfo(make_unique<PredicateInfo>(F, *DT, *AC)), SQ(DL, TLI, DT, AC) {
   }
   bool runGVN();
+  // Returns true if the last runGVN gave up because the fixpoint did not
+  // converge within the iteration budget.
+  bool exceededBudget() const { return BudgetExceeded; }
 
 private:
   // Expression handling.
@@ -696,7 +725,8 @@ private:
   void addAdditionalUsers(Value *To, Value *User) const;
 
   // Main loop of value numbering
-  void iterateTouchedInstructions();
+  bool iterateTouchedInstructions(unsigned ProcessedLimit = 0);
+  void removePredicateInfoCopies();
 
   // Utilities.
   void cleanupTables();
@@ -3018,16 +3048,26 @@ void NewGVN::verifyStoreExpressions() const {
 // This is the main value numbering loop, it iterates over the initial touched
 // instruction set, propagating value numbers, marking things touched, etc,
 // until the set of touched instructions is completely empty.
-void NewGVN::iterateTouchedInstructions() {
+// If ProcessedLimit is nonzero, or MaxIterations is set, gives up once the
+// corresponding budget is exhausted and returns false.  The partially iterated
+// state is optimistic and must not be used to transform the function.
+bool NewGVN::iterateTouchedInstructions(unsigned ProcessedLimit) {
   unsigned int Iterations = 0;
+  unsigned Processed = 0;
   // Figure out where touchedinstructions starts
   int FirstInstr = TouchedInstructions.find_first();
   // Nothing set, nothing to iterate, just return.
   if (FirstInstr == -1)
-    return;
+    return true;
   const BasicBlock *LastBlock = getBlockForValue(InstrFromDFSNum(FirstInstr));
   while (TouchedInstructions.any()) {
     ++Iterations;
+    if (MaxIterations && Iterations > MaxIterations) {
+      DEBUG(dbgs() << "Giving up on " << F.getName() << " after "
+                   << MaxIterations << " iterations\n");
+      NumGVNValuesProcessed += Processed;
+      return false;
+    }
     // Walk through all the instructions in all the blocks in RPO.
     // TODO: As we hit a new block, we should push and pop equalities into a
     // table lookupOperandLeader can use, to catch things PredicateInfo
@@ -3070,12 +3110,35 @@ void NewGVN::iterateTouchedInstructions() {
         llvm_unreachable("Should have been a MemoryPhi or Instruction");
       }
       updateProcessedCount(V);
+      if (ProcessedLimit && ++Processed > ProcessedLimit) {
+        DEBUG(dbgs() << "Giving up on " << F.getName() << " after processing "
+                     << ProcessedLimit << " values\n");
+        NumGVNValuesProcessed += Processed;
+        return false;
+      }
       // Reset after processing (because we may mark ourselves as touched when
       // we propagate equalities).
       TouchedInstructions.reset(InstrNum);
     }
   }
   NumGVNMaxIterations = std::max(NumGVNMaxIterations.getValue(), Iterations);
+  NumGVNValuesProcessed += Processed;
+  return true;
+}
+
+// Undo the ssa.copy intrinsics PredicateInfo inserted, leaving the function as
+// we found it.  Used when we bail out before elimination, which is normally
+// what gets rid of them.
+void NewGVN::removePredicateInfoCopies() {
+  for (auto &BB : F)
+    for (auto I = BB.begin(), E = BB.end(); I != E;) {
+      auto *II = dyn_cast<IntrinsicInst>(&*I++);
+      if (!II || II->getIntrinsicID() != Intrinsic::ssa_copy ||
+          !PredInfo->getPredicateInfoFor(II))
+        continue;
+      II->replaceAllUsesWith(II->getOperand(0));
+      II->eraseFromParent();
+    }
 }
 
 // This is the main transformation entry point.
@@ -3139,11 +3202,24 @@ bool NewGVN::runGVN() {
                << " marked reachable\n");
   ReachableBlocks.insert(&F.getEntryBlock());
 
-  iterateTouchedInstructions();
+  {
+    NamedRegionTimer T("fixpoint", "NewGVN fixpoint iteration",
+                       NewGVNTimerGroupName, NewGVNTimerGroupDescription,
+                       TimePassesIsEnabled);
+    if (!iterateTouchedInstructions(MaxProcessedPerInst * ICount)) {
+      ++NumGVNBudgetExceeded;
+      BudgetExceeded = true;
+      removePredicateInfoCopies();
+      cleanupTables();
+      return false;
+    }
+  }
   verifyMemoryCongruency();
   verifyIterationSettled(F);
   verifyStoreExpressions();
 
+  NamedRegionTimer T("eliminate", "NewGVN elimination", NewGVNTimerGroupName,
+                     NewGVNTimerGroupDescription, TimePassesIsEnabled);
   Changed |= eliminateInstructions(F);
 
   // Delete all instructions marked for deletion.
@@ -3872,6 +3948,8 @@ private:
 bool NewGVNLegacyPass::runOnFunction(Function &F) {
   if (skipFunction(F))
     return false;
+  // The legacy pass manager gives us no way to run classic GVN from here, so
+  // a function that exceeds the budget is simply left unchanged.
   return NewGVN(F, &getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
                 &getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F),
                 &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(),
@@ -3906,9 +3984,12 @@ PreservedAnalyses NewGVNPass::run(Function &F, AnalysisManager<Function> &AM) {
   auto &TLI = AM.getResult<TargetLibraryAnalysis>(F);
   auto &AA = AM.getResult<AAManager>(F);
   auto &MSSA = AM.getResult<MemorySSAAnalysis>(F).getMSSA();
-  bool Changed =
-      NewGVN(F, &DT, &AC, &TLI, &AA, &MSSA, F.getParent()->getDataLayout())
-          .runGVN();
+  NewGVN Impl(F, &DT, &AC, &TLI, &AA, &MSSA, F.getParent()->getDataLayout());
+  bool Changed = Impl.runGVN();
+  // NewGVN gave up without touching the function; fall back to classic GVN so
+  // that we still get the usual redundancy elimination.
+  if (Impl.exceededBudget())
+    return GVN().run(F, AM);
   if (!Changed)
     return PreservedAnalyses::all();
   PreservedAnalyses PA;
@@ -37,6 +37,7 @@
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/ValueHandle.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
@@ -50,6 +51,12 @@ using namespace reassociate;
 STATISTIC(NumChanged, "Number of insts reassociated");
 STATISTIC(NumAnnihil, "Number of expr tree annihilated");
 STATISTIC(NumFactor , "Number of multiplies factored");
+STATISTIC(NumCanonical, "Number of expr trees already in canonical form");
+
+static cl::opt<bool> SkipCanonicalTrees(
+    "reassociate-skip-canonical", cl::init(true), cl::Hidden,
+    cl::desc("Don't linearize expression trees that are already in the form "
+             "this pass would rewrite them to"));
 
 #ifndef NDEBUG
 /// Print out the expression identified in the Ops list.
@@ -608,6 +615,70 @@ static bool LinearizeExprTree(BinaryOperator *I,
   return Changed;
 }
 
+/// Return true if reassociating the expression tree rooted at I can't change
+/// it, so that it need not be linearized. This is a conservative check for
+/// the shape RewriteExprTree emits: a left-leaning chain of single use nodes
+/// whose right-hand operands, followed by the left-hand and then the
+/// right-hand operand of the last node, are distinct leaves in strictly
+/// decreasing rank order. A tree is
+/// rejected if any leaf is something LinearizeExprTree or OptimizeExpression
+/// might morph, cancel or factor, or if a constant leaf could fold.
+static bool isCanonicalExprTree(BinaryOperator *I,
+                                function_ref<unsigned(Value *)> GetRank) {
+  unsigned Opcode = I->getOpcode();
+  bool IsFP = isa<FPMathOperator>(I);
+
+  auto IsInertLeaf = [&](Value *V) {
+    if (auto *C = dyn_cast<Constant>(V))
+      return !IsFP && isa<ConstantInt>(C) && !C->isNullValue() &&
+             !C->isOneValue() && !C->isAllOnesValue();
+    auto *BO = dyn_cast<BinaryOperator>(V);
+    if (!BO)
+      return true;
+    if (BinaryOperator::isNeg(BO) || BinaryOperator::isFNeg(BO) ||
+        BinaryOperator::isNot(BO))
+      return false;
+    switch (BO->getOpcode()) {
+    case Instruction::Mul:
+    case Instruction::FMul:
+    case Instruction::Shl:
+    case Instruction::Sub:
+    case Instruction::FSub:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      return false;
+    default:
+      return BO->getOpcode() != Opcode;
+    }
+  };
+
+  SmallVector<Value *, 8> Leaves;
+  BinaryOperator *Node = I;
+  while (BinaryOperator *Next = isReassociableOp(Node->getOperand(0), Opcode)) {
+    Leaves.push_back(Node->getOperand(1));
+    Node = Next;
+  }
+  // The last node gets the two lowest ranked leaves, the higher one on the
+  // left.
+  Leaves.push_back(Node->getOperand(0));
+  Leaves.push_back(Node->getOperand(1));
+
+  SmallPtrSet<Value *, 8> Seen;
+  unsigned PrevRank = ~0U;
+  for (Value *V : Leaves) {
+    if (!IsInertLeaf(V) || !Seen.insert(V).second)
+      return false;
+    // Ties are ordered by how LinearizeExprTree happens to find the leaves;
+    // don't try to predict that.
+    unsigned Rank = GetRank(V);
+    if (Rank >= PrevRank)
+      return false;
+    PrevRank = Rank;
+  }
+  return true;
+}
+
 /// Now that the operands for this expression tree are
 /// linearized and optimized, emit them in-order.
 void ReassociatePass::RewriteExprTree(BinaryOperator *I,
@@ -2099,6 +2170,16 @@ void ReassociatePass::OptimizeInst(Instruction *I) {
 }
 
 void ReassociatePass::ReassociateExpression(BinaryOperator *I) {
+  // Trees that a previous run of this pass, or an earlier visit in this one,
+  // already put in canonical form come out unchanged; don't bother
+  // linearizing them again.
+  if (SkipCanonicalTrees &&
+      isCanonicalExprTree(I, [this](Value *V) { return getRank(V); })) {
+    DEBUG(dbgs() << "RA: Canonical tree: " << *I << '\n');
+    ++NumCanonical;
+    return;
+  }
+
   // First, walk the expression tree, linearizing the tree, collecting the
   // operand information.
   SmallVector<RepeatedValue, 8> Tree;
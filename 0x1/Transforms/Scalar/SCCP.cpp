@@ -28,12 +28,14 @@
 #include "llvm/Analysis/GlobalsModRef.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/IR/ConstantRange.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
@@ -42,16 +44,36 @@
 #include "llvm/Transforms/Scalar/SCCP.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include <algorithm>
+#include <memory>
 using namespace llvm;
 
 #define DEBUG_TYPE "sccp"
 
 STATISTIC(NumInstRemoved, "Number of instructions removed");
 STATISTIC(NumDeadBlocks , "Number of basic blocks unreachable");
+STATISTIC(NumRangesWidened, "Number of value ranges widened to the full set");
 
 STATISTIC(IPNumInstRemoved, "Number of instructions removed by IPSCCP");
 STATISTIC(IPNumArgsElimed ,"Number of arguments constant propagated by IPSCCP");
 STATISTIC(IPNumGlobalConst, "Number of globals found to be constant by IPSCCP");
+STATISTIC(IPNumFunctionsSolved,
+          "Number of times IPSCCP drained a function's local work lists");
+
+static cl::opt<bool> SCCPUseRanges(
+    "sccp-use-ranges", cl::init(false), cl::Hidden,
+    cl::desc("Track the range of overdefined integer values and use it to "
+             "fold compares and prune switch cases"));
+
+static cl::opt<unsigned> SCCPRangeWideningLimit(
+    "sccp-range-widening-limit", cl::init(8), cl::Hidden,
+    cl::desc("Number of times the range of a value may grow before it is "
+             "widened to the full set"));
+
+static cl::opt<bool> IPSCCPFunctionWorkLists(
+    "ipsccp-function-worklists", cl::init(false), cl::Hidden,
+    cl::desc("Keep IPSCCP work lists per function and solve one function's "
+             "local lattice at a time, exchanging only argument, return and "
+             "global values between functions"));
 
 namespace {
 /// LatticeVal class - This class represents the different lattice values that
@@ -175,6 +197,23 @@ class SCCPSolver : public InstVisitor<SCCPSolver> {
   ///
   DenseMap<std::pair<Value*, unsigned>, LatticeVal> StructValueState;
 
+  /// RangeState - The range of values an overdefined integer instruction may
+  /// take, and how many times that range has grown. Ranges only ever grow;
+  /// once a range has grown more than SCCPRangeWideningLimit times it is
+  /// widened to the full set, which bounds the number of times each value is
+  /// revisited.
+  struct RangeState {
+    ConstantRange Range;
+    unsigned Updates;
+    RangeState(ConstantRange Range) : Range(std::move(Range)), Updates(0) {}
+  };
+
+  /// ValueRanges - When UseRanges is set, this extends the lattice below
+  /// 'overdefined' for integer instructions: an overdefined value with an
+  /// entry here is known to lie within its range.
+  bool UseRanges;
+  DenseMap<Value*, RangeState> ValueRanges;
+
   /// GlobalValue - If we are tracking any values for the contents of a global
   /// variable, we keep a mapping from the constant accessor to the element of
   /// the global, to the currently known value.  If the value becomes
@@ -212,13 +251,29 @@ class SCCPSolver : public InstVisitor<SCCPSolver> {
 
   SmallVector<BasicBlock*, 64>  BBWorkList;  // The BasicBlock work list
 
+  /// LocalWorkList - When solving with per-function work lists, the items
+  /// that only affect the lattice of one function are queued here rather than
+  /// on the solver-wide lists above, which then only carry values that cross
+  /// function boundaries: tracked return values and global variables.
+  struct LocalWorkList {
+    SmallVector<Value*, 16> OverdefinedInstWorkList;
+    SmallVector<Value*, 16> InstWorkList;
+    SmallVector<BasicBlock*, 16> BBWorkList;
+    bool Pending = false;
+  };
+  bool PerFunctionWorkLists;
+  DenseMap<Function*, std::unique_ptr<LocalWorkList>> LocalWorkLists;
+  SmallVector<Function*, 16> PendingFunctions;
+
   /// KnownFeasibleEdges - Entries in this set are edges which have already had
   /// PHI nodes retriggered.
   typedef std::pair<BasicBlock*, BasicBlock*> Edge;
   DenseSet<Edge> KnownFeasibleEdges;
 public:
-  SCCPSolver(const DataLayout &DL, const TargetLibraryInfo *tli)
-      : DL(DL), TLI(tli) {}
+  SCCPSolver(const DataLayout &DL, const TargetLibraryInfo *tli,
+             bool PerFunctionWorkLists = false)
+      : DL(DL), TLI(tli), UseRanges(SCCPUseRanges),
+        PerFunctionWorkLists(PerFunctionWorkLists) {}
 
   /// MarkBlockExecutable - This method can be used by clients to mark all of
   /// the blocks that are known to be intrinsically live in the processed unit.
@@ -228,7 +283,10 @@ public:
     if (!BBExecutable.insert(BB).second)
       return false;
     DEBUG(dbgs() << "Marking Block Executable: " << BB->getName() << '\n');
-    BBWorkList.push_back(BB);  // Add the block to the work list!
+    if (LocalWorkList *WL = getLocalWorkList(BB))
+      WL->BBWorkList.push_back(BB);
+    else
+      BBWorkList.push_back(BB);  // Add the block to the work list!
     return true;
   }
 
@@ -339,8 +397,44 @@ public:
   }
 
 private:
+  /// getLocalWorkList - If per-function work lists are in use and V belongs
+  /// to a single function, return that function's work list, scheduling the
+  /// function to be solved. Otherwise return null.
+  LocalWorkList *getLocalWorkList(Value *V) {
+    if (!PerFunctionWorkLists)
+      return nullptr;
+    Function *F;
+    if (auto *I = dyn_cast<Instruction>(V))
+      F = I->getFunction();
+    else if (auto *A = dyn_cast<Argument>(V))
+      F = A->getParent();
+    else if (auto *BB = dyn_cast<BasicBlock>(V))
+      F = BB->getParent();
+    else
+      return nullptr;
+
+    std::unique_ptr<LocalWorkList> &WL = LocalWorkLists[F];
+    if (!WL)
+      WL = make_unique<LocalWorkList>();
+    if (!WL->Pending) {
+      WL->Pending = true;
+      PendingFunctions.push_back(F);
+    }
+    return WL.get();
+  }
+
+  /// solveWorkLists - Process the given work lists until they are empty.
+  void solveWorkLists(SmallVectorImpl<Value*> &OverdefinedWL,
+                      SmallVectorImpl<Value*> &InstWL,
+                      SmallVectorImpl<BasicBlock*> &BBWL);
+
   // pushToWorkList - Helper for markConstant/markForcedConstant/markOverdefined
   void pushToWorkList(LatticeVal &IV, Value *V) {
+    if (LocalWorkList *WL = getLocalWorkList(V)) {
+      if (IV.isOverdefined())
+        return WL->OverdefinedInstWorkList.push_back(V);
+      return WL->InstWorkList.push_back(V);
+    }
     if (IV.isOverdefined())
       return OverdefinedInstWorkList.push_back(V);
     InstWorkList.push_back(V);
@@ -474,7 +568,7 @@ private:
       PHINode *PN;
       for (BasicBlock::iterator I = Dest->begin();
            (PN = dyn_cast<PHINode>(I)); ++I)
-        visitPHINode(*PN);
+        visitAndUpdateRange(*PN);
     }
   }
 
@@ -494,9 +588,30 @@ private:
   //
   void OperandChangedState(Instruction *I) {
     if (BBExecutable.count(I->getParent()))   // Inst is executable?
-      visit(*I);
+      visitAndUpdateRange(*I);
+  }
+
+  // visitAndUpdateRange - Visit I, then recompute its range if it is an
+  // overdefined integer.
+  void visitAndUpdateRange(Instruction &I) {
+    visit(I);
+    if (UseRanges)
+      updateRange(I);
   }
 
+  /// getRange - Return the range of values V may take given the current
+  /// lattice: empty while V is unknown, a single element if it is a constant
+  /// integer, and the tracked range (or the full set) once it is overdefined.
+  ConstantRange getRange(Value *V);
+
+  /// updateRange - Recompute the range of the overdefined integer
+  /// instruction I from its operands, and revisit its users if it grew.
+  void updateRange(Instruction &I);
+
+  /// getCompareFromRanges - Return the result of the integer compare I if
+  /// it is implied by the ranges of its operands, or null otherwise.
+  Constant *getCompareFromRanges(CmpInst &I);
+
 private:
   friend class InstVisitor<SCCPSolver>;
 
@@ -597,6 +712,17 @@ void SCCPSolver::getFeasibleSuccessors(TerminatorInst &TI,
     LatticeVal SCValue = getValueState(SI->getCondition());
     ConstantInt *CI = SCValue.getConstantInt();
 
+    if (!CI && UseRanges && SCValue.isOverdefined()) {
+      // Only the cases within the range of the condition are executable. The
+      // default destination is always assumed to be.
+      ConstantRange Range = getRange(SI->getCondition());
+      Succs[0] = true;
+      for (auto Case : SI->cases())
+        if (Range.contains(Case.getCaseValue()->getValue()))
+          Succs[Case.getSuccessorIndex()] = true;
+      return;
+    }
+
     if (!CI) {   // Overdefined or unknown condition?
       // All destinations are executable!
       if (!SCValue.isUnknown())
@@ -680,6 +806,17 @@ bool SCCPSolver::isEdgeFeasible(BasicBlock *From, BasicBlock *To) {
     LatticeVal SCValue = getValueState(SI->getCondition());
     ConstantInt *CI = SCValue.getConstantInt();
 
+    if (!CI && UseRanges && SCValue.isOverdefined()) {
+      if (SI->getDefaultDest() == To)
+        return true;
+      ConstantRange Range = getRange(SI->getCondition());
+      for (auto Case : SI->cases())
+        if (Case.getCaseSuccessor() == To &&
+            Range.contains(Case.getCaseValue()->getValue()))
+          return true;
+      return false;
+    }
+
     if (!CI)
       return !SCValue.isUnknown();
 
@@ -1003,9 +1140,103 @@ void SCCPSolver::visitCmpInst(CmpInst &I) {
   if (!V1State.isOverdefined() && !V2State.isOverdefined())
     return;
 
+  // The ranges of the operands may still decide the compare.
+  if (UseRanges)
+    if (Constant *C = getCompareFromRanges(I)) {
+      if (IV.isConstant() && IV.getConstant() != C)
+        return markOverdefined(IV, &I);
+      return markConstant(IV, &I, C);
+    }
+
   markOverdefined(&I);
 }
 
+ConstantRange SCCPSolver::getRange(Value *V) {
+  unsigned BitWidth = V->getType()->getIntegerBitWidth();
+  LatticeVal LV = getValueState(V);
+  if (LV.isUnknown())
+    return ConstantRange(BitWidth, /*isFullSet=*/false);
+  if (ConstantInt *CI = LV.getConstantInt())
+    return ConstantRange(CI->getValue());
+  if (LV.isOverdefined()) {
+    auto It = ValueRanges.find(V);
+    if (It != ValueRanges.end())
+      return It->second.Range;
+  }
+  return ConstantRange(BitWidth, /*isFullSet=*/true);
+}
+
+void SCCPSolver::updateRange(Instruction &I) {
+  if (!I.getType()->isIntegerTy() || !getValueState(&I).isOverdefined())
+    return;
+
+  unsigned BitWidth = I.getType()->getIntegerBitWidth();
+  ConstantRange Range(BitWidth, /*isFullSet=*/true);
+  if (auto *PN = dyn_cast<PHINode>(&I)) {
+    Range = ConstantRange(BitWidth, /*isFullSet=*/false);
+    for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i)
+      if (isEdgeFeasible(PN->getIncomingBlock(i), PN->getParent()))
+        Range = Range.unionWith(getRange(PN->getIncomingValue(i)));
+  } else if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
+    ConstantRange LHS = getRange(BO->getOperand(0));
+    ConstantRange RHS = getRange(BO->getOperand(1));
+    // X urem C is in [0, C), which ConstantRange doesn't know about.
+    const APInt *C = RHS.getSingleElement();
+    if (BO->getOpcode() == Instruction::URem && C && !!*C)
+      Range = ConstantRange(APInt::getNullValue(BitWidth), *C);
+    else
+      Range = LHS.binaryOp(BO->getOpcode(), RHS);
+  } else if (auto *CI = dyn_cast<CastInst>(&I)) {
+    if (CI->getSrcTy()->isIntegerTy())
+      Range = getRange(CI->getOperand(0)).castOp(CI->getOpcode(), BitWidth);
+  } else if (auto *SI = dyn_cast<SelectInst>(&I)) {
+    Range = getRange(SI->getTrueValue()).unionWith(
+        getRange(SI->getFalseValue()));
+  }
+
+  // An overdefined value has some value; don't let operands that are still
+  // unknown make it look like it has none.
+  if (Range.isEmptySet())
+    Range = ConstantRange(BitWidth, /*isFullSet=*/true);
+
+  // The first range computed for I was computed when I became overdefined,
+  // before any of its users saw it, so there is nothing to revisit.
+  auto Ins = ValueRanges.insert(std::make_pair(&I, RangeState(Range)));
+  if (Ins.second)
+    return;
+
+  RangeState &RS = Ins.first->second;
+  ConstantRange NewRange = RS.Range.unionWith(Range);
+  if (NewRange == RS.Range)
+    return;
+  if (++RS.Updates > SCCPRangeWideningLimit) {
+    NewRange = ConstantRange(BitWidth, /*isFullSet=*/true);
+    ++NumRangesWidened;
+  }
+  RS.Range = NewRange;
+  DEBUG(dbgs() << "updateRange: " << NewRange << ": " << I << '\n');
+  pushToWorkList(ValueState[&I], &I);
+}
+
+Constant *SCCPSolver::getCompareFromRanges(CmpInst &I) {
+  auto *ICI = dyn_cast<ICmpInst>(&I);
+  if (!ICI || !ICI->getOperand(0)->getType()->isIntegerTy())
+    return nullptr;
+
+  ConstantRange LHS = getRange(ICI->getOperand(0));
+  ConstantRange RHS = getRange(ICI->getOperand(1));
+  if (LHS.isEmptySet() || RHS.isEmptySet())
+    return nullptr;
+
+  CmpInst::Predicate Pred = ICI->getPredicate();
+  if (ConstantRange::makeSatisfyingICmpRegion(Pred, RHS).contains(LHS))
+    return ConstantInt::getTrue(ICI->getType());
+  if (ConstantRange::makeSatisfyingICmpRegion(CmpInst::getInversePredicate(Pred),
+                                              RHS).contains(LHS))
+    return ConstantInt::getFalse(ICI->getType());
+  return nullptr;
+}
+
 // Handle getelementptr instructions.  If all operands are constants then we
 // can turn this into a getelementptr ConstantExpr.
 //
@@ -1200,11 +1431,35 @@ CallOverdefined:
 void SCCPSolver::Solve() {
   // Process the work lists until they are empty!
   while (!BBWorkList.empty() || !InstWorkList.empty() ||
-         !OverdefinedInstWorkList.empty()) {
+         !OverdefinedInstWorkList.empty() || !PendingFunctions.empty()) {
+    solveWorkLists(OverdefinedInstWorkList, InstWorkList, BBWorkList);
+
+    // With per-function work lists, the solver-wide lists only hold values
+    // that cross function boundaries. Solve each function's local lattice to
+    // a fixpoint before looking at those again; that only feeds new argument
+    // and return values back through the shared lists.
+    while (!PendingFunctions.empty()) {
+      Function *F = PendingFunctions.pop_back_val();
+      LocalWorkList &WL = *LocalWorkLists[F];
+      DEBUG(dbgs() << "\nSolving function: " << F->getName() << '\n');
+      ++IPNumFunctionsSolved;
+      // F stays marked pending while it is drained, so anything it queues for
+      // itself is picked up here instead of rescheduling it.
+      solveWorkLists(WL.OverdefinedInstWorkList, WL.InstWorkList,
+                     WL.BBWorkList);
+      WL.Pending = false;
+    }
+  }
+}
+
+void SCCPSolver::solveWorkLists(SmallVectorImpl<Value*> &OverdefinedWL,
+                                SmallVectorImpl<Value*> &InstWL,
+                                SmallVectorImpl<BasicBlock*> &BBWL) {
+  while (!BBWL.empty() || !InstWL.empty() || !OverdefinedWL.empty()) {
     // Process the overdefined instruction's work list first, which drives other
     // things to overdefined more quickly.
-    while (!OverdefinedInstWorkList.empty()) {
-      Value *I = OverdefinedInstWorkList.pop_back_val();
+    while (!OverdefinedWL.empty()) {
+      Value *I = OverdefinedWL.pop_back_val();
 
       DEBUG(dbgs() << "\nPopped off OI-WL: " << *I << '\n');
 
@@ -1221,8 +1476,8 @@ void SCCPSolver::Solve() {
     }
 
     // Process the instruction work list.
-    while (!InstWorkList.empty()) {
-      Value *I = InstWorkList.pop_back_val();
+    while (!InstWL.empty()) {
+      Value *I = InstWL.pop_back_val();
 
       DEBUG(dbgs() << "\nPopped off I-WL: " << *I << '\n');
 
@@ -1240,15 +1495,16 @@ void SCCPSolver::Solve() {
     }
 
     // Process the basic block work list.
-    while (!BBWorkList.empty()) {
-      BasicBlock *BB = BBWorkList.back();
-      BBWorkList.pop_back();
+    while (!BBWL.empty()) {
+      BasicBlock *BB = BBWL.back();
+      BBWL.pop_back();
 
       DEBUG(dbgs() << "\nPopped off BBWL: " << *BB << '\n');
 
       // Notify all instructions in this basic block that they are newly
       // executable.
-      visit(BB);
+      for (Instruction &I : *BB)
+        visitAndUpdateRange(I);
     }
   }
 }
@@ -1751,7 +2007,7 @@ static void findReturnsToZap(Function &F,
 
 static bool runIPSCCP(Module &M, const DataLayout &DL,
                       const TargetLibraryInfo *TLI) {
-  SCCPSolver Solver(DL, TLI);
+  SCCPSolver Solver(DL, TLI, IPSCCPFunctionWorkLists);
 
   // AddressTakenFunctions - This set keeps track of the address-taken functions
   // that are in the input.  As IPSCCP runs through and simplifies code,
@@ -1881,7 +2137,21 @@ static bool runIPSCCP(Module &M, const DataLayout &DL,
         // Ignore blockaddress users; BasicBlock's dtor will handle them.
         if (!I) continue;
 
-        bool Folded = ConstantFoldTerminator(I->getParent());
+        // A switch on an overdefined value whose range excludes some cases
+        // still branches to them; drop those cases first, as folding the
+        // switch could turn them into a conditional branch to DeadBB.
+        bool Folded = false;
+        if (auto *SI = dyn_cast<SwitchInst>(I))
+          for (auto Case = SI->case_begin(); Case != SI->case_end();) {
+            if (Case->getCaseSuccessor() != DeadBB) {
+              ++Case;
+              continue;
+            }
+            DeadBB->removePredecessor(SI->getParent());
+            Case = SI->removeCase(Case);
+            Folded = true;
+          }
+        Folded |= ConstantFoldTerminator(I->getParent());
         assert(Folded &&
               "Expect TermInst on constantint or blockaddress to be folded");
         (void) Folded;
@@ -55,6 +55,7 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include <limits>
 
 #ifndef NDEBUG
 // We only use this for a debug check.
@@ -87,6 +88,12 @@ static cl::opt<bool> SROARandomShuffleSlices("sroa-random-shuffle-slices",
 static cl::opt<bool> SROAStrictInbounds("sroa-strict-inbounds", cl::init(false),
                                         cl::Hidden);
 
+/// Hidden option controlling how many slices an alloca needs before they are
+/// sorted with a radix sort rather than std::sort.
+static cl::opt<unsigned> SROARadixSortThreshold(
+    "sroa-radix-sort-threshold", cl::init(512), cl::Hidden,
+    cl::desc("Minimum number of slices for SROA to radix sort them"));
+
 namespace {
 /// \brief A custom IRBuilder inserter which prefixes all names, but only in
 /// Assert builds.
@@ -187,6 +194,65 @@ template <typename T> struct isPodLike;
 template <> struct isPodLike<Slice> { static const bool value = true; };
 }
 
+/// \brief Sort slices into the order defined by Slice::operator<.
+///
+/// Allocas of large aggregates can have tens of thousands of slices, and
+/// a comparison sort of them dominates building the slices. When both offsets
+/// are small enough, the whole ordering packs into a single 64-bit key:
+/// ascending begin offset, then unsplittable first, then descending end
+/// offset. Those keys are sorted with an LSD radix sort and the slices are
+/// permuted to match.
+static void sortSlices(MutableArrayRef<Slice> Slices) {
+  if (Slices.size() < SROARadixSortThreshold ||
+      Slices.size() > std::numeric_limits<uint32_t>::max()) {
+    std::sort(Slices.begin(), Slices.end());
+    return;
+  }
+
+  uint64_t MaxBegin = 0, MaxEnd = 0;
+  for (const Slice &S : Slices) {
+    MaxBegin = std::max(MaxBegin, S.beginOffset());
+    MaxEnd = std::max(MaxEnd, S.endOffset());
+  }
+  unsigned EndBits = 64 - countLeadingZeros(MaxEnd);
+  unsigned KeyBits = (64 - countLeadingZeros(MaxBegin)) + 1 + EndBits;
+  if (KeyBits > 64) {
+    std::sort(Slices.begin(), Slices.end());
+    return;
+  }
+
+  typedef std::pair<uint64_t, uint32_t> KeyAndIndex;
+  SmallVector<KeyAndIndex, 0> Keys, Scratch;
+  Keys.reserve(Slices.size());
+  for (unsigned Idx = 0, E = Slices.size(); Idx != E; ++Idx) {
+    const Slice &S = Slices[Idx];
+    // If the end offset needs all but one bit, the begin offset must be zero.
+    uint64_t Key = EndBits + 1 < 64 ? S.beginOffset() << (EndBits + 1) : 0;
+    Key |= uint64_t(S.isSplittable()) << EndBits;
+    Key |= MaxEnd - S.endOffset();
+    Keys.push_back({Key, Idx});
+  }
+  Scratch.resize(Keys.size());
+
+  // Only sort the digits that can actually be set.
+  for (unsigned Shift = 0; Shift < KeyBits; Shift += 8) {
+    unsigned Counts[257] = {};
+    for (const KeyAndIndex &K : Keys)
+      ++Counts[((K.first >> Shift) & 0xff) + 1];
+    for (unsigned Digit = 0; Digit != 256; ++Digit)
+      Counts[Digit + 1] += Counts[Digit];
+    for (const KeyAndIndex &K : Keys)
+      Scratch[Counts[(K.first >> Shift) & 0xff]++] = K;
+    Keys.swap(Scratch);
+  }
+
+  SmallVector<Slice, 0> Sorted;
+  Sorted.reserve(Slices.size());
+  for (const KeyAndIndex &K : Keys)
+    Sorted.push_back(Slices[K.second]);
+  std::copy(Sorted.begin(), Sorted.end(), Slices.begin());
+}
+
 /// \brief Representation of the alloca slices.
 ///
 /// This class represents the slices of an alloca which are formed by its
@@ -230,7 +296,7 @@ public:
     int OldSize = Slices.size();
     Slices.append(NewSlices.begin(), NewSlices.end());
     auto SliceI = Slices.begin() + OldSize;
-    std::sort(SliceI, Slices.end());
+    sortSlices(makeMutableArrayRef(SliceI, Slices.end() - SliceI));
     std::inplace_merge(Slices.begin(), SliceI, Slices.end());
   }
 
@@ -405,10 +471,15 @@ class AllocaSlices::partition_iterator
   /// FIXME: Do we really?
   uint64_t MaxSplitSliceEndOffset;
 
+  /// \brief The minimum split end offset, so that we only walk the split
+  /// tails looking for ones to drop when at least one of them has ended.
+  uint64_t MinSplitSliceEndOffset;
+
   /// \brief Sets the partition to be empty at given iterator, and sets the
   /// end iterator.
   partition_iterator(AllocaSlices::iterator SI, AllocaSlices::iterator SE)
-      : P(SI), SE(SE), MaxSplitSliceEndOffset(0) {
+      : P(SI), SE(SE), MaxSplitSliceEndOffset(0),
+        MinSplitSliceEndOffset(std::numeric_limits<uint64_t>::max()) {
     // If not already at the end, advance our state to form the initial
     // partition.
     if (SI != SE)
@@ -428,14 +499,23 @@ class AllocaSlices::partition_iterator
         // If we've finished all splits, this is easy.
         P.SplitTails.clear();
         MaxSplitSliceEndOffset = 0;
+        MinSplitSliceEndOffset = std::numeric_limits<uint64_t>::max();
       } else {
         // Remove the uses which have ended in the prior partition. This
         // cannot change the max split slice end because we just checked that
-        // the prior partition ended prior to that max.
-        P.SplitTails.erase(
-            remove_if(P.SplitTails,
-                      [&](Slice *S) { return S->endOffset() <= P.EndOffset; }),
-            P.SplitTails.end());
+        // the prior partition ended prior to that max. If none of them have
+        // ended there is nothing to remove, so don't walk the list at all.
+        if (P.EndOffset >= MinSplitSliceEndOffset) {
+          P.SplitTails.erase(remove_if(P.SplitTails,
+                                       [&](Slice *S) {
+                                         return S->endOffset() <= P.EndOffset;
+                                       }),
+                             P.SplitTails.end());
+          MinSplitSliceEndOffset = std::numeric_limits<uint64_t>::max();
+          for (Slice *S : P.SplitTails)
+            MinSplitSliceEndOffset =
+                std::min(S->endOffset(), MinSplitSliceEndOffset);
+        }
         assert(any_of(P.SplitTails,
                       [&](Slice *S) {
                         return S->endOffset() == MaxSplitSliceEndOffset;
@@ -466,6 +546,8 @@ class AllocaSlices::partition_iterator
           P.SplitTails.push_back(&S);
           MaxSplitSliceEndOffset =
               std::max(S.endOffset(), MaxSplitSliceEndOffset);
+          MinSplitSliceEndOffset =
+              std::min(S.endOffset(), MinSplitSliceEndOffset);
         }
 
       // Start from the end of the previous partition.
@@ -1009,7 +1091,7 @@ AllocaSlices::AllocaSlices(const DataLayout &DL, AllocaInst &AI)
 
   // Sort the uses. This arranges for the offsets to be in ascending order,
   // and the sizes to be in descending order.
-  std::sort(Slices.begin(), Slices.end());
+  sortSlices(Slices);
 }
 
 #if !defined(NDEBUG) || defined(LLVM_ENABLE_DUMP)
@@ -3986,7 +4068,7 @@ bool SROA::splitAlloca(AllocaInst &AI, AllocaSlices &AS) {
     }
   }
   if (!IsSorted)
-    std::sort(AS.begin(), AS.end());
+    sortSlices(makeMutableArrayRef(AS.begin(), AS.end() - AS.begin()));
 
   /// Describes the allocas introduced by rewritePartition in order to migrate
   /// the debug info.
@@ -8,14 +8,20 @@
 //===----------------------------------------------------------------------===//
 //
 // This file implements the CloneModule interface which makes a copy of an
-// entire module.
+// entire module, and the CloneModuleLazily interface which defers copying
+// function bodies until they are materialized.
 //
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CloneModuleLazily.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Constant.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GVMaterializer.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm-c/Core.h"
 using namespace llvm;
@@ -29,6 +35,88 @@ static void copyComdat(GlobalObject *Dst, const GlobalObject *Src) {
   Dst->setComdat(DC);
 }
 
+/// Copy the body of Src into its already created clone F, mapping references
+/// through VMap.
+static void cloneFunctionBody(Function *F, const Function &Src,
+                              ValueToValueMapTy &VMap) {
+  Function::arg_iterator DestI = F->arg_begin();
+  for (Function::const_arg_iterator J = Src.arg_begin(); J != Src.arg_end();
+       ++J) {
+    DestI->setName(J->getName());
+    VMap[&*J] = &*DestI++;
+  }
+
+  SmallVector<ReturnInst *, 8> Returns; // Ignore returns cloned.
+  CloneFunctionInto(F, &Src, VMap, /*ModuleLevelChanges=*/true, Returns);
+
+  if (Src.hasPersonalityFn())
+    F->setPersonalityFn(MapValue(Src.getPersonalityFn(), VMap));
+}
+
+namespace {
+/// Materializer for modules created by CloneModuleLazily. Function bodies are
+/// left empty and materializable in the clone, and are copied from the source
+/// module the first time they are materialized. The value map is owned here so
+/// that bodies cloned later resolve references to the same globals and
+/// metadata as everything cloned up front.
+class CloneMaterializer : public GVMaterializer {
+  const Module &SrcM;
+  ValueToValueMapTy VMap;
+  DenseMap<Function *, const Function *> PendingBodies;
+  bool StripDebugInfo = false;
+
+public:
+  explicit CloneMaterializer(const Module &SrcM) : SrcM(SrcM) {}
+
+  ValueToValueMapTy &getValueMap() { return VMap; }
+
+  void deferBody(Function *F, const Function *Src) {
+    PendingBodies[F] = Src;
+    F->setIsMaterializable(true);
+  }
+
+  Error materialize(GlobalValue *GV) override {
+    auto *F = dyn_cast<Function>(GV);
+    if (!F)
+      return Error::success();
+    auto I = PendingBodies.find(F);
+    if (I == PendingBodies.end())
+      return Error::success();
+    const Function *Src = I->second;
+    PendingBodies.erase(I);
+
+    F->setIsMaterializable(false);
+    cloneFunctionBody(F, *Src, VMap);
+    if (StripDebugInfo)
+      stripDebugInfo(*F);
+    return Error::success();
+  }
+
+  Error materializeModule() override {
+    while (!PendingBodies.empty())
+      if (Error Err = materialize(PendingBodies.begin()->first))
+        return Err;
+    return Error::success();
+  }
+
+  // Everything other than function bodies is cloned up front.
+  Error materializeMetadata() override { return Error::success(); }
+  void setStripDebugInfo() override { StripDebugInfo = true; }
+
+  // Module::getIdentifiedStructTypes() defers to the materializer, and the
+  // types used by bodies not cloned yet are only reachable from the source,
+  // which shares its context, and so its types, with the clone.
+  std::vector<StructType *> getIdentifiedStructTypes() const override {
+    return SrcM.getIdentifiedStructTypes();
+  }
+};
+} // end anonymous namespace
+
+static std::unique_ptr<Module>
+cloneModuleImpl(const Module *M, ValueToValueMapTy &VMap,
+                function_ref<bool(const GlobalValue *)> ShouldCloneDefinition,
+                CloneMaterializer *Materializer);
+
 /// This is not as easy as it might seem because we have to worry about making
 /// copies of global variables and functions, and making their (initializers and
 /// references, respectively) refer to the right globals.
@@ -48,6 +136,38 @@ std::unique_ptr<Module> llvm::CloneModule(const Module *M,
 std::unique_ptr<Module> llvm::CloneModule(
     const Module *M, ValueToValueMapTy &VMap,
     function_ref<bool(const GlobalValue *)> ShouldCloneDefinition) {
+  return cloneModuleImpl(M, VMap, ShouldCloneDefinition,
+                         /*Materializer=*/nullptr);
+}
+
+/// Like CloneModule, but function bodies are only copied when they are first
+/// materialized in the clone, e.g. by a pass manager about to run over them or
+/// an explicit call to materializeAll(). Functions that are never looked at
+/// are never copied, which saves both time and memory when most of the clone
+/// is left untouched.
+///
+/// The source module is referenced until every body has been materialized, so
+/// it must outlive the clone (or the clone must be fully materialized first),
+/// and it must not be modified in the meantime.
+std::unique_ptr<Module> llvm::CloneModuleLazily(const Module *M) {
+  return CloneModuleLazily(M, [](const GlobalValue *GV) { return true; });
+}
+
+std::unique_ptr<Module> llvm::CloneModuleLazily(
+    const Module *M,
+    function_ref<bool(const GlobalValue *)> ShouldCloneDefinition) {
+  auto *Materializer = new CloneMaterializer(*M);
+  std::unique_ptr<Module> New = cloneModuleImpl(
+      M, Materializer->getValueMap(), ShouldCloneDefinition, Materializer);
+  // The module takes ownership of the materializer.
+  New->setMaterializer(Materializer);
+  return New;
+}
+
+static std::unique_ptr<Module>
+cloneModuleImpl(const Module *M, ValueToValueMapTy &VMap,
+                function_ref<bool(const GlobalValue *)> ShouldCloneDefinition,
+                CloneMaterializer *Materializer) {
   // First off, we need to create the new module.
   std::unique_ptr<Module> New =
       llvm::make_unique<Module>(M->getModuleIdentifier(), M->getContext());
@@ -152,18 +272,11 @@ std::unique_ptr<Module> llvm::CloneModule(
       continue;
     }
 
-    Function::arg_iterator DestI = F->arg_begin();
-    for (Function::const_arg_iterator J = I.arg_begin(); J != I.arg_end();
-         ++J) {
-      DestI->setName(J->getName());
-      VMap[&*J] = &*DestI++;
-    }
-
-    SmallVector<ReturnInst *, 8> Returns; // Ignore returns cloned.
-    CloneFunctionInto(F, &I, VMap, /*ModuleLevelChanges=*/true, Returns);
-
-    if (I.hasPersonalityFn())
-      F->setPersonalityFn(MapValue(I.getPersonalityFn(), VMap));
+    assert(!I.isMaterializable() && "Source function must be materialized!");
+    if (Materializer)
+      Materializer->deferBody(F, &I);
+    else
+      cloneFunctionBody(F, I, VMap);
 
     copyComdat(F, &I);
   }
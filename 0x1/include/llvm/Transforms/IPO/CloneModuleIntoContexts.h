@@ -0,0 +1,40 @@
+//===- CloneModuleIntoContexts.h - Partitioned module copies ----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares CloneModuleIntoContexts, which makes partitioned copies
+// of a module, each in its own LLVMContext, in parallel.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_IPO_CLONEMODULEINTOCONTEXTS_H
+#define LLVM_TRANSFORMS_IPO_CLONEMODULEINTOCONTEXTS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include <memory>
+#include <vector>
+
+namespace llvm {
+
+class GlobalValue;
+class LLVMContext;
+class Module;
+
+/// Return one copy of M per entry of Contexts, created in that context. The
+/// copy for partition I has definitions for the globals that
+/// ShouldCloneDefinition(I, GV) selects and external declarations for the
+/// rest. The entries of Contexts must be distinct, and none of them may be in
+/// use by another thread during the call.
+std::vector<std::unique_ptr<Module>> CloneModuleIntoContexts(
+    const Module *M, ArrayRef<LLVMContext *> Contexts,
+    function_ref<bool(unsigned, const GlobalValue *)> ShouldCloneDefinition);
+
+} // end namespace llvm
+
+#endif // LLVM_TRANSFORMS_IPO_CLONEMODULEINTOCONTEXTS_H
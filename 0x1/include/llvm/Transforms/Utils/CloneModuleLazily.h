@@ -0,0 +1,41 @@
+//===- CloneModuleLazily.h - Clone a module on demand -----------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares CloneModuleLazily, a variant of CloneModule (see
+// Cloning.h) that defers copying function bodies until they are materialized.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_UTILS_CLONEMODULELAZILY_H
+#define LLVM_TRANSFORMS_UTILS_CLONEMODULELAZILY_H
+
+#include "llvm/ADT/STLExtras.h"
+#include <memory>
+
+namespace llvm {
+
+class GlobalValue;
+class Module;
+
+/// Return a copy of the specified module whose function bodies are only
+/// copied when they are first materialized. The source module must outlive
+/// the clone, or the clone must be fully materialized first, and it must not
+/// be modified in the meantime.
+std::unique_ptr<Module> CloneModuleLazily(const Module *M);
+
+/// As above, but only the definitions selected by ShouldCloneDefinition are
+/// copied; every other global becomes an external declaration, as with
+/// CloneModule.
+std::unique_ptr<Module> CloneModuleLazily(
+    const Module *M,
+    function_ref<bool(const GlobalValue *)> ShouldCloneDefinition);
+
+} // end namespace llvm
+
+#endif // LLVM_TRANSFORMS_UTILS_CLONEMODULELAZILY_H
@@ -0,0 +1,52 @@
+; RUN: opt < %s -basicaa -dse -enable-dse-memoryssa -S | FileCheck %s
+
+@G = global [100 x i32] zeroinitializer
+@X = global i32 0
+
+; Overwritten on both paths out of the entry block.
+define void @diamond(i1 %c) {
+; CHECK-LABEL: @diamond(
+; CHECK-NOT:     store i32 0
+; CHECK:       a:
+; CHECK-NEXT:    store i32 1, i32* @X
+; CHECK:       b:
+; CHECK-NEXT:    store i32 2, i32* @X
+entry:
+  store i32 0, i32* @X
+  br i1 %c, label %a, label %b
+a:
+  store i32 1, i32* @X
+  ret void
+b:
+  store i32 2, i32* @X
+  ret void
+}
+
+; The store in %s is not dead: going round the loop, the store in %h writes
+; the next element, not the one %s wrote.
+define void @loop() {
+; CHECK-LABEL: @loop(
+; CHECK:       h:
+; CHECK:         store i32 0, i32* %p
+; CHECK:       s:
+; CHECK-NEXT:    store i32 1, i32* %p
+; CHECK:       e:
+; CHECK-NEXT:    store i32 2, i32* %p
+entry:
+  br label %h
+h:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %l ]
+  %p = getelementptr [100 x i32], [100 x i32]* @G, i64 0, i64 %i
+  store i32 0, i32* %p
+  br label %s
+s:
+  store i32 1, i32* %p
+  br label %l
+l:
+  %i.next = add i64 %i, 1
+  %cmp = icmp ult i64 %i.next, 100
+  br i1 %cmp, label %h, label %e
+e:
+  store i32 2, i32* %p
+  ret void
+}
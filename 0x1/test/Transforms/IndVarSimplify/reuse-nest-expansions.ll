@@ -0,0 +1,74 @@
+; RUN: opt < %s -indvars -S | FileCheck %s
+; RUN: opt < %s -indvars -stats -disable-output 2>&1 | FileCheck %s --check-prefix=STATS
+; REQUIRES: asserts
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+
+; The inner loop's exit value and limit, smax(1, %k), is also the outer loop's
+; limit. The outer loop reuses the expansion made for the inner loop.
+
+; STATS: {{[1-9][0-9]*}} indvars - Number of SCEV expansions reused within a loop nest
+
+define void @nest(i32 %k, i32* %p) {
+; CHECK-LABEL: @nest(
+; CHECK:       entry:
+; CHECK:         [[SMAX:%.*]] = select
+; CHECK-NOT:     select
+; CHECK:         icmp ne i32 %j.next, [[SMAX]]
+; CHECK:         store volatile i32
+; CHECK:         icmp ne i32 %i.next, [[SMAX]]
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %inner
+
+inner:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %inner ]
+  %j.next = add nsw i32 %j, 1
+  %c.inner = icmp slt i32 %j.next, %k
+  br i1 %c.inner, label %inner, label %outer.latch
+
+outer.latch:
+  %j.lcssa = phi i32 [ %j.next, %inner ]
+  store volatile i32 %j.lcssa, i32* %p
+  %i.next = add nsw i32 %i, 1
+  %c.outer = icmp slt i32 %i.next, %k
+  br i1 %c.outer, label %outer, label %exit
+
+exit:
+  ret void
+}
+
+; Same shape in another function, whose loops may be allocated where @nest's
+; were: nothing of @nest's may be reused here.
+define void @nest2(i32 %k, i32* %p) {
+; CHECK-LABEL: @nest2(
+; CHECK:       entry:
+; CHECK:         [[SMAX2:%.*]] = select
+; CHECK:         icmp ne i32 %j.next, [[SMAX2]]
+; CHECK:         icmp ne i32 %i.next, [[SMAX2]]
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %inner
+
+inner:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %inner ]
+  %j.next = add nsw i32 %j, 1
+  %c.inner = icmp slt i32 %j.next, %k
+  br i1 %c.inner, label %inner, label %outer.latch
+
+outer.latch:
+  %j.lcssa = phi i32 [ %j.next, %inner ]
+  store volatile i32 %j.lcssa, i32* %p
+  %i.next = add nsw i32 %i, 1
+  %c.outer = icmp slt i32 %i.next, %k
+  br i1 %c.outer, label %outer, label %exit
+
+exit:
+  ret void
+}
@@ -0,0 +1,82 @@
+; RUN: opt < %s -jump-threading -jump-threading-fsm -S | FileCheck %s
+
+declare void @a()
+declare i1 @b()
+declare i32 @get()
+declare void @use(i32)
+declare i1 @check(i32)
+
+; A loop-carried state machine switching in the loop header. Every path into
+; the header carries a known state, so each gets its own copy of the latch
+; and header that jumps straight to the next state.
+define void @loop_carried() {
+; CHECK-LABEL: @loop_carried(
+; CHECK-NOT:     switch
+; CHECK:         call void @a()
+; CHECK-NOT:     switch
+; CHECK:         call i1 @b()
+; CHECK-NOT:     switch
+; CHECK:         ret void
+entry:
+  br label %loop
+
+loop:
+  %state = phi i32 [ 0, %entry ], [ %next, %latch ]
+  switch i32 %state, label %exit [
+    i32 0, label %s0
+    i32 1, label %s1
+  ]
+
+s0:
+  call void @a()
+  br label %latch
+
+s1:
+  %c = call i1 @b()
+  br i1 %c, label %latch, label %exit
+
+latch:
+  %next = phi i32 [ 1, %s0 ], [ 0, %s1 ]
+  br label %loop
+
+exit:
+  ret void
+}
+
+; The switch is below the loop header, so the threaded paths run through the
+; header, which defines a value that is used after the path. Repairing SSA for
+; it puts PHIs into blocks of the path that have no copy.
+define i32 @through_header() {
+; CHECK-LABEL: @through_header(
+; CHECK-NOT:     switch
+; CHECK:         ret i32
+entry:
+  br label %header
+
+header:
+  %state = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %h = call i32 @get()
+  br label %dispatch
+
+dispatch:
+  switch i32 %state, label %exit [
+    i32 0, label %s0
+    i32 1, label %s1
+  ]
+
+s0:
+  call void @use(i32 %h)
+  br label %latch
+
+s1:
+  %c = call i1 @check(i32 %h)
+  br i1 %c, label %latch, label %exit
+
+latch:
+  %next = phi i32 [ 1, %s0 ], [ 0, %s1 ]
+  br label %header
+
+exit:
+  %r = phi i32 [ %h, %dispatch ], [ %h, %s1 ]
+  ret i32 %r
+}
@@ -0,0 +1,59 @@
+; With a MemorySSA computed ahead of the loop pipeline, LICM answers its
+; invariance queries from it. Without one, -licm-use-memssa falls back to alias
+; sets rather than computing MemorySSA inside the loop pass manager. Both give
+; the same result; promotion is off because the MemorySSA mode does not promote.
+; RUN: opt < %s -loop-simplify -lcssa -memoryssa -licm -licm-use-memssa -disable-licm-promotion -stats -S 2>&1 | FileCheck %s --check-prefixes=CHECK,MSSA
+; RUN: opt < %s -licm -licm-use-memssa -disable-licm-promotion -stats -S 2>&1 | FileCheck %s --check-prefixes=CHECK,AST
+; RUN: opt < %s -loop-rotate -licm -licm-use-memssa -disable-licm-promotion -stats -S 2>&1 | FileCheck %s --check-prefixes=CHECK,AST
+; REQUIRES: asserts
+
+@G = global i32 0
+
+; The load of @G is not clobbered in the loop; the store to %p is.
+define i32 @hoist(i32* noalias %p, i32 %n) {
+; CHECK-LABEL: @hoist(
+; CHECK:       entry:
+; CHECK:         %g = load i32, i32* @G
+; CHECK:       loop:
+; CHECK-NOT:     load i32, i32* @G
+; CHECK:         store i32
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %g = load i32, i32* @G
+  %v = add i32 %g, %i
+  store i32 %v, i32* %p
+  %i.next = add nsw i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i32 %v
+}
+
+; Stored to in the loop: the load stays.
+define void @clobbered(i32 %n) {
+; CHECK-LABEL: @clobbered(
+; CHECK:       loop:
+; CHECK-NEXT:    %i = phi
+; CHECK-NEXT:    %g = load i32, i32* @G
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %g = load i32, i32* @G
+  %v = add i32 %g, 1
+  store i32 %v, i32* @G
+  %i.next = add nsw i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+; MSSA: {{[1-9][0-9]*}} licm - Number of invariance queries answered by MemorySSA
+; AST-NOT: Number of invariance queries answered by MemorySSA
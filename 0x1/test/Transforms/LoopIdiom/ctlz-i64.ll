@@ -0,0 +1,45 @@
+; RUN: opt < %s -loop-idiom -S | FileCheck %s
+;
+; The ctlz idiom over an unsigned 64-bit word, which shifts logically.
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; int bits(unsigned long n) {
+;   int i = 0;
+;   while (n) {
+;     n >>= 1;
+;     i++;
+;   }
+;   return i;
+; }
+define i32 @ctlz_lshr_i64(i64 %n) {
+; CHECK-LABEL: @ctlz_lshr_i64(
+; CHECK: [[CTLZ:%.*]] = call i64 @llvm.ctlz.i64(i64 %n, i1 true)
+; CHECK-NEXT: [[COUNT:%.*]] = sub i64 64, [[CTLZ]]
+; CHECK-NEXT: trunc i64 [[COUNT]] to i32
+; CHECK: %tcphi = phi i64 [ [[COUNT]], %while.body.preheader ], [ %tcdec, %while.body ]
+; CHECK: %tcdec = sub nsw i64 %tcphi, 1
+; CHECK: icmp eq i64 %tcdec, 0
+entry:
+  %tobool4 = icmp eq i64 %n, 0
+  br i1 %tobool4, label %while.end, label %while.body.preheader
+
+while.body.preheader:
+  br label %while.body
+
+while.body:
+  %i.06 = phi i32 [ %inc, %while.body ], [ 0, %while.body.preheader ]
+  %n.addr.05 = phi i64 [ %shr, %while.body ], [ %n, %while.body.preheader ]
+  %shr = lshr i64 %n.addr.05, 1
+  %inc = add nsw i32 %i.06, 1
+  %tobool = icmp eq i64 %shr, 0
+  br i1 %tobool, label %while.end.loopexit, label %while.body
+
+while.end.loopexit:
+  br label %while.end
+
+while.end:
+  %i.0.lcssa = phi i32 [ 0, %entry ], [ %inc, %while.end.loopexit ]
+  ret i32 %i.0.lcssa
+}
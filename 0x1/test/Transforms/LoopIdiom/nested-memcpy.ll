@@ -0,0 +1,135 @@
+; RUN: opt < %s -basicaa -loop-idiom -S | FileCheck %s
+;
+; A memcpy of one row per iteration, such as the one left behind by an inner
+; loop that has already been turned into a memcpy, is promoted to a single
+; memcpy when the rows are contiguous.
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare void @llvm.memcpy.p0i8.p0i8.i64(i8* nocapture, i8* nocapture readonly, i64, i32, i1)
+
+; for (i = 0; i < 8; ++i)
+;   for (j = 0; j < 16; ++j)
+;     a[i][j] = b[i][j];
+define void @copy_2d([16 x i32]* noalias %a, [16 x i32]* noalias %b) {
+; CHECK-LABEL: @copy_2d(
+; CHECK: entry:
+; CHECK: call void @llvm.memcpy.p0i8.p0i8.i64(i8* {{.*}}, i8* {{.*}}, i64 512, i32 4, i1 false)
+; CHECK: {{^}}outer:
+; CHECK-NOT: call void @llvm.memcpy
+; CHECK: ret void
+entry:
+  br label %outer
+
+outer:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %inner
+
+inner:
+  %j = phi i64 [ 0, %outer ], [ %j.next, %inner ]
+  %src = getelementptr inbounds [16 x i32], [16 x i32]* %b, i64 %i, i64 %j
+  %v = load i32, i32* %src, align 4
+  %dst = getelementptr inbounds [16 x i32], [16 x i32]* %a, i64 %i, i64 %j
+  store i32 %v, i32* %dst, align 4
+  %j.next = add nuw nsw i64 %j, 1
+  %inner.done = icmp eq i64 %j.next, 16
+  br i1 %inner.done, label %outer.latch, label %inner
+
+outer.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %outer.done = icmp eq i64 %i.next, 8
+  br i1 %outer.done, label %exit, label %outer
+
+exit:
+  ret void
+}
+
+; A runtime row length is fine as long as it is also the row pitch.
+define void @copy_pitch(i8* noalias %dst, i8* noalias %src, i64 %pitch,
+                        i64 %rows) {
+; CHECK-LABEL: @copy_pitch(
+; CHECK: entry:
+; CHECK: call void @llvm.memcpy.p0i8.p0i8.i64(i8* %dst, i8* %src, i64 %{{.*}}, i32 1, i1 false)
+; CHECK: {{^}}loop:
+; CHECK-NOT: call void @llvm.memcpy
+; CHECK: ret void
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %off = mul i64 %i, %pitch
+  %d = getelementptr inbounds i8, i8* %dst, i64 %off
+  %s = getelementptr inbounds i8, i8* %src, i64 %off
+  call void @llvm.memcpy.p0i8.p0i8.i64(i8* %d, i8* %s, i64 %pitch, i32 1, i1 false)
+  %i.next = add nuw i64 %i, 1
+  %done = icmp eq i64 %i.next, %rows
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; Each row is copied onto the next one, so the source is written by the loop
+; and the copies cannot be merged. Nothing may be left in the preheader.
+define void @copy_overlap(i8* %p) {
+; CHECK-LABEL: @copy_overlap(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: br label %loop
+; CHECK: call void @llvm.memcpy.p0i8.p0i8.i64(i8* %d, i8* %s, i64 64, i32 1, i1 false)
+; CHECK-NOT: call void @llvm.memcpy
+; CHECK: ret void
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %off = shl i64 %i, 6
+  %s = getelementptr inbounds i8, i8* %p, i64 %off
+  %off.next = add i64 %off, 64
+  %d = getelementptr inbounds i8, i8* %p, i64 %off.next
+  call void @llvm.memcpy.p0i8.p0i8.i64(i8* %d, i8* %s, i64 64, i32 1, i1 false)
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, 8
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; Under optsize the outer loop, a multi-block top-level loop, is left alone.
+; Only the inner loop is turned into a memcpy, and nothing is expanded into
+; the outer preheader.
+define void @copy_2d_optsize([16 x i32]* noalias %a, [16 x i32]* noalias %b) optsize {
+; CHECK-LABEL: @copy_2d_optsize(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: br label %outer
+; CHECK: call void @llvm.memcpy.p0i8.p0i8.i64(i8* {{.*}}, i8* {{.*}}, i64 64, i32 4, i1 false)
+; CHECK-NOT: call void @llvm.memcpy
+; CHECK: ret void
+entry:
+  br label %outer
+
+outer:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %inner
+
+inner:
+  %j = phi i64 [ 0, %outer ], [ %j.next, %inner ]
+  %src = getelementptr inbounds [16 x i32], [16 x i32]* %b, i64 %i, i64 %j
+  %v = load i32, i32* %src, align 4
+  %dst = getelementptr inbounds [16 x i32], [16 x i32]* %a, i64 %i, i64 %j
+  store i32 %v, i32* %dst, align 4
+  %j.next = add nuw nsw i64 %j, 1
+  %inner.done = icmp eq i64 %j.next, 16
+  br i1 %inner.done, label %outer.latch, label %inner
+
+outer.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %outer.done = icmp eq i64 %i.next, 8
+  br i1 %outer.done, label %exit, label %outer
+
+exit:
+  ret void
+}
@@ -0,0 +1,112 @@
+; RUN: opt < %s -memcpyopt -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+
+; The second block only runs after the first: merged into one memset there.
+define void @straight(i32* %p) {
+; CHECK-LABEL: @straight(
+; CHECK:       entry:
+; CHECK-NOT:     store
+; CHECK:       next:
+; CHECK-NOT:     store
+; CHECK:         call void @llvm.memset.p0i8.i64(i8* {{.*}}, i8 0, i64 16, i32 4, i1 false)
+; CHECK-NEXT:    ret void
+entry:
+  %p1 = getelementptr i32, i32* %p, i64 1
+  %p2 = getelementptr i32, i32* %p, i64 2
+  %p3 = getelementptr i32, i32* %p, i64 3
+  store i32 0, i32* %p, align 4
+  store i32 0, i32* %p1, align 4
+  br label %next
+
+next:
+  store i32 0, i32* %p2, align 4
+  store i32 0, i32* %p3, align 4
+  ret void
+}
+
+; The side block only computes a value.
+define i32 @triangle(i32* %p, i1 %c, i32 %a) {
+; CHECK-LABEL: @triangle(
+; CHECK:       entry:
+; CHECK-NOT:     store
+; CHECK:       join:
+; CHECK-NOT:     store
+; CHECK:         call void @llvm.memset.p0i8.i64(i8* {{.*}}, i8 0, i64 16, i32 4, i1 false)
+; CHECK-NEXT:    ret i32
+entry:
+  %p1 = getelementptr i32, i32* %p, i64 1
+  %p2 = getelementptr i32, i32* %p, i64 2
+  %p3 = getelementptr i32, i32* %p, i64 3
+  store i32 0, i32* %p, align 4
+  store i32 0, i32* %p1, align 4
+  br i1 %c, label %side, label %join
+
+side:
+  %x = add i32 %a, 1
+  br label %join
+
+join:
+  %r = phi i32 [ %x, %side ], [ %a, %entry ]
+  store i32 0, i32* %p2, align 4
+  store i32 0, i32* %p3, align 4
+  ret i32 %r
+}
+
+define i32 @diamond(i32* %p, i1 %c, i32 %a) {
+; CHECK-LABEL: @diamond(
+; CHECK:       entry:
+; CHECK-NOT:     store
+; CHECK:       join:
+; CHECK-NOT:     store
+; CHECK:         call void @llvm.memset.p0i8.i64(i8* {{.*}}, i8 0, i64 16, i32 4, i1 false)
+; CHECK-NEXT:    ret i32
+entry:
+  %p1 = getelementptr i32, i32* %p, i64 1
+  %p2 = getelementptr i32, i32* %p, i64 2
+  %p3 = getelementptr i32, i32* %p, i64 3
+  store i32 0, i32* %p, align 4
+  store i32 0, i32* %p1, align 4
+  br i1 %c, label %left, label %right
+
+left:
+  %x = add i32 %a, 1
+  br label %join
+
+right:
+  %y = mul i32 %a, 3
+  br label %join
+
+join:
+  %r = phi i32 [ %x, %left ], [ %y, %right ]
+  store i32 0, i32* %p2, align 4
+  store i32 0, i32* %p3, align 4
+  ret i32 %r
+}
+
+; Two unreachable blocks that only branch to each other: the scan must not
+; come back round to the block it started in and collect its stores twice.
+define void @unreachable_cycle(i32* %p) {
+; CHECK-LABEL: @unreachable_cycle(
+; CHECK:       a:
+; CHECK-NEXT:    br label %b
+; CHECK:       b:
+; CHECK-NOT:     store
+; CHECK:         call void @llvm.memset.p0i8.i64(i8* {{.*}}, i8 0, i64 16, i32 4, i1 false)
+; CHECK-NEXT:    br label %a
+entry:
+  %p1 = getelementptr i32, i32* %p, i64 1
+  %p2 = getelementptr i32, i32* %p, i64 2
+  %p3 = getelementptr i32, i32* %p, i64 3
+  ret void
+
+a:
+  store i32 0, i32* %p, align 4
+  store i32 0, i32* %p1, align 4
+  br label %b
+
+b:
+  store i32 0, i32* %p2, align 4
+  store i32 0, i32* %p3, align 4
+  br label %a
+}
@@ -0,0 +1,34 @@
+; RUN: opt < %s -reassociate -S | FileCheck %s
+; RUN: opt < %s -reassociate -reassociate-skip-canonical=false -S | FileCheck %s
+
+; Trees whose last node has its lower ranked leaf on the left are not in the
+; form RewriteExprTree produces and must still be rewritten.
+
+define i32 @test1(i32 %low, i32 %high) {
+; CHECK-LABEL: @test1(
+; CHECK-NEXT:    [[R:%.*]] = add i32 %high, %low
+; CHECK-NEXT:    ret i32 [[R]]
+  %r = add i32 %low, %high
+  ret i32 %r
+}
+
+define i32 @test2(i32 %a, i32 %b, i32 %c) {
+; CHECK-LABEL: @test2(
+; CHECK-NEXT:    [[T:%.*]] = add i32 %b, %a
+; CHECK-NEXT:    [[R:%.*]] = add i32 [[T]], %c
+; CHECK-NEXT:    ret i32 [[R]]
+  %t = add i32 %a, %b
+  %r = add i32 %t, %c
+  ret i32 %r
+}
+
+; Already in canonical form: comes out unchanged.
+define i32 @test3(i32 %a, i32 %b, i32 %c) {
+; CHECK-LABEL: @test3(
+; CHECK-NEXT:    [[T:%.*]] = add i32 %b, %a
+; CHECK-NEXT:    [[R:%.*]] = add i32 [[T]], %c
+; CHECK-NEXT:    ret i32 [[R]]
+  %t = add i32 %b, %a
+  %r = add i32 %t, %c
+  ret i32 %r
+}
@@ -0,0 +1,93 @@
+//===- CloneModuleIntoContextsTest.cpp - Partitioned module copies --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO/CloneModuleIntoContexts.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+
+using namespace llvm;
+
+namespace {
+
+static std::unique_ptr<Module> parseIR(LLVMContext &C, const char *IR) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseAssemblyString(IR, Err, C);
+  if (!M)
+    Err.print("CloneModuleIntoContextsTest", errs());
+  return M;
+}
+
+static const char *PartitionedIR = R"(
+  @g = global i32 1
+
+  define i32 @f(i32 %x) {
+    %v = load i32, i32* @g
+    %r = add i32 %x, %v
+    ret i32 %r
+  }
+
+  define i32 @h(i32 %x) {
+    %r = call i32 @f(i32 %x)
+    ret i32 %r
+  }
+)";
+
+TEST(CloneModuleIntoContexts, TwoContexts) {
+  LLVMContext SrcContext;
+  std::unique_ptr<Module> M = parseIR(SrcContext, PartitionedIR);
+  ASSERT_TRUE(M);
+
+  // Partition 0 keeps @f and @g, partition 1 keeps @h.
+  LLVMContext C0, C1;
+  LLVMContext *Contexts[] = {&C0, &C1};
+  std::vector<std::unique_ptr<Module>> Clones = CloneModuleIntoContexts(
+      M.get(), Contexts, [](unsigned I, const GlobalValue *GV) {
+        return (GV->getName() == "h") == (I == 1);
+      });
+  ASSERT_EQ(2u, Clones.size());
+
+  for (unsigned I = 0; I != 2; ++I) {
+    Module &Clone = *Clones[I];
+    EXPECT_EQ(Contexts[I], &Clone.getContext());
+    EXPECT_FALSE(verifyModule(Clone, &errs()));
+
+    Function *F = Clone.getFunction("f");
+    Function *H = Clone.getFunction("h");
+    GlobalVariable *G = Clone.getGlobalVariable("g");
+    ASSERT_TRUE(F && H && G);
+    EXPECT_EQ(I != 0, F->isDeclaration());
+    EXPECT_EQ(I != 1, H->isDeclaration());
+    EXPECT_EQ(I != 0, G->isDeclaration());
+  }
+
+  // The source module is left alone.
+  EXPECT_FALSE(M->getFunction("f")->isDeclaration());
+  EXPECT_FALSE(M->getFunction("h")->isDeclaration());
+  EXPECT_FALSE(M->getGlobalVariable("g")->isDeclaration());
+}
+
+TEST(CloneModuleIntoContexts, NoContexts) {
+  LLVMContext SrcContext;
+  std::unique_ptr<Module> M = parseIR(SrcContext, PartitionedIR);
+  ASSERT_TRUE(M);
+
+  EXPECT_TRUE(CloneModuleIntoContexts(M.get(), None,
+                                      [](unsigned, const GlobalValue *) {
+                                        return true;
+                                      })
+                  .empty());
+}
+
+} // end anonymous namespace